@@ -70,6 +70,19 @@ enum Parameters
 	OSCRetrigger1,
 	OSCRetrigger2,
 	OSCRetrigger3,
+	DecoderThreads1,
+	DecoderThreads2,
+	DecoderThreads3,
+	LowLatencyDecoding1,
+	LowLatencyDecoding2,
+	LowLatencyDecoding3,
+	MemoryMappedReads,
+	Crossfade,
+	PacketCacheSize,
+	PacketCacheClipSize,
+	GpuLoopMemory,
+	AdaptiveQuality,
+	MaxDecoders,
 	NumParameters
 }; /**< The parameters of the VST plugin */
 
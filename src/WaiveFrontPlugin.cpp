@@ -62,6 +62,19 @@ public:
         parameters[OSCRetrigger1] = true;
         parameters[OSCRetrigger2] = true;
         parameters[OSCRetrigger3] = true;
+        parameters[DecoderThreads1] = 0;
+        parameters[DecoderThreads2] = 0;
+        parameters[DecoderThreads3] = 0;
+        parameters[LowLatencyDecoding1] = false;
+        parameters[LowLatencyDecoding2] = false;
+        parameters[LowLatencyDecoding3] = false;
+        parameters[MemoryMappedReads] = false;
+        parameters[Crossfade] = 0.5f;
+        parameters[PacketCacheSize] = 256.0f;
+        parameters[PacketCacheClipSize] = 32.0f;
+        parameters[GpuLoopMemory] = 512.0f;
+        parameters[AdaptiveQuality] = 1.0f;
+        parameters[MaxDecoders] = 12;
     }
 
 protected:
@@ -191,6 +204,75 @@ protected:
             parameter.name = "OSC Retrigger 3";
             parameter.hints |= kParameterIsBoolean;
             break;
+        case DecoderThreads1:
+            parameter.name = "Decoder Threads 1";
+            parameter.hints |= kParameterIsInteger;
+            parameter.ranges.min = 0;
+            parameter.ranges.max = 16;
+            break;
+        case DecoderThreads2:
+            parameter.name = "Decoder Threads 2";
+            parameter.hints |= kParameterIsInteger;
+            parameter.ranges.min = 0;
+            parameter.ranges.max = 16;
+            break;
+        case DecoderThreads3:
+            parameter.name = "Decoder Threads 3";
+            parameter.hints |= kParameterIsInteger;
+            parameter.ranges.min = 0;
+            parameter.ranges.max = 16;
+            break;
+        case LowLatencyDecoding1:
+            parameter.name = "Low Latency Decoding 1";
+            parameter.hints |= kParameterIsBoolean;
+            break;
+        case LowLatencyDecoding2:
+            parameter.name = "Low Latency Decoding 2";
+            parameter.hints |= kParameterIsBoolean;
+            break;
+        case LowLatencyDecoding3:
+            parameter.name = "Low Latency Decoding 3";
+            parameter.hints |= kParameterIsBoolean;
+            break;
+        case MemoryMappedReads:
+            parameter.name = "Memory Mapped Reads";
+            parameter.hints |= kParameterIsBoolean;
+            break;
+        case Crossfade:
+            parameter.name = "Crossfade";
+            parameter.ranges.max = 2.0f;
+            parameter.ranges.def = 0.5f;
+            break;
+        case PacketCacheSize:
+            parameter.name = "Packet Cache Size";
+            parameter.ranges.max = 2048.0f;
+            parameter.ranges.def = 256.0f;
+            parameter.unit = "MB";
+            break;
+        case PacketCacheClipSize:
+            parameter.name = "Packet Cache Clip Size";
+            parameter.ranges.max = 256.0f;
+            parameter.ranges.def = 32.0f;
+            parameter.unit = "MB";
+            break;
+        case GpuLoopMemory:
+            parameter.name = "GPU Loop Memory";
+            parameter.ranges.max = 2048.0f;
+            parameter.ranges.def = 512.0f;
+            parameter.unit = "MB";
+            break;
+        case AdaptiveQuality:
+            parameter.name = "Adaptive Quality";
+            parameter.hints |= kParameterIsBoolean;
+            parameter.ranges.def = 1.0f;
+            break;
+        case MaxDecoders:
+            parameter.name = "Max Decoders";
+            parameter.hints |= kParameterIsInteger;
+            parameter.ranges.min = 1;
+            parameter.ranges.max = 32;
+            parameter.ranges.def = 12;
+            break;
         default:
             break;
         }
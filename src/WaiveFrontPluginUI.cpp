@@ -29,7 +29,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "assets/themes/CinderTheme.cpp"
 #include "Application.hpp"
 #include "DearImGui.hpp"
-#include "video/VideoLoader.cpp"
+#include "video/VideoPlayer.cpp"
+#include "video/VideoPrefetcher.cpp"
 #include "video/VideoFrameDescription.h"
 
 #ifdef __APPLE__
@@ -45,6 +46,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "data/DataSources.hpp"
 #include "util/Logger.cpp"
 #include <vector>
+#include <utility>
 #include "osc/OSCServer.cpp"
 
 using namespace Util::Logger;
@@ -99,17 +101,30 @@ public:
 
         for (int i = 0; i < 3; i++)
         {
-            videoLoaders.push_back(new VideoLoader());
+            videoPlayers.push_back(new VideoPlayer());
+            standbyPlayers.push_back(new VideoPlayer());
             selectedCategories.push_back(nullptr);
             selectedItems.push_back(nullptr);
             layersEnabled.push_back(i == 0);
             layerNotes.push_back(notes[i]);
             layerRetrigger.push_back(true);
+            layerDecoderThreads.push_back(0);
+            layerLowLatency.push_back(false);
+            layersLoaded.push_back(i == 0);
+            layersSwitching.push_back(false);
+            layersFading.push_back(false);
+            layerSources.push_back(-1);
+            layerStartTimes.push_back(0);
             lastMessages.push_back("");
         }
 
         loadDataSources(std::string(home) + "/Documents/WAIVE");
 
+        prefetcher = new VideoPrefetcher();
+        prefetcher->setCategories(dataSources.categories);
+        // Both players of every layer decode during a crossfade, and one more for a decoder reopened at a lower resolution
+        prefetcher->setReservedDecoders(2 * videoPlayers.size() + 1);
+
         for (int i = 0; i < 3; i++)
         {
             int randomIndex = std::rand() % dataSources.categories.size();
@@ -120,6 +135,25 @@ public:
         oscServer = new OSCServer(8000, &dataSources);
     }
 
+    /**
+     * @brief Destroy the WAIVE-FRONT Plugin UI object, stopping the decode threads
+     *
+     */
+    ~WaiveFrontPluginUI()
+    {
+        delete prefetcher;
+
+        for (VideoPlayer *videoPlayer : videoPlayers)
+        {
+            delete videoPlayer;
+        }
+
+        for (VideoPlayer *videoPlayer : standbyPlayers)
+        {
+            delete videoPlayer;
+        }
+    }
+
 protected:
     bool pRandomizeCategory[3] = {false, false, false}; /**< Whether to randomize the category on the next frame */
     bool pRandomizeItem[3] = {false, false, false};     /**< Whether to randomize the item on the next frame */
@@ -253,31 +287,196 @@ protected:
     void selectCategory(int i, DataCategory *category)
     {
         selectedCategories[i] = category;
+        prefetcher->prioritize(category);
 
         print("DATA", "Selected category: " + category->name);
         randomizeItem(i);
     }
 
     /**
-     * @brief Select an item
+     * @brief Select an item, which is opened on the standby player of the layer and faded in once its first frame is ready
+     *
+     * When another layer started the same item within a frame, so both playheads are at its start, the layer shows the frames of that layer instead.
      *
      * @param i The index of the layer to change the item for
      * @param item The item to select
      */
     void selectItem(int i, DataItem *item)
     {
+        // Layers that share the item the layer played go on without it
+        splitLayer(i);
+
         selectedItems[i] = item;
 
         print("DATA", "Selected item: " + selectedItems[i]->title);
 
-        std::string scenePath = selectedItems[i]->source->path + "/items/" + selectedItems[i]->filename + ".mp4";
+        // Disabled layers hold no decoder, the item is loaded once the layer is enabled
+        if (!layersEnabled[i])
+            return;
+
+        int64_t currentTime = getCurrentTime();
+        layerStartTimes[i] = currentTime;
+
+        for (int j = 0; j < layerSources.size(); j++)
+        {
+            // A layer that started the item earlier is somewhere else in it, joining it would skip the start
+            if (currentTime - layerStartTimes[j] > shareWindow)
+                continue;
+
+            if (j != i && layersEnabled[j] && layerSources[j] < 0 && selectedItems[j] == item && (layersSwitching[j] || videoPlayers[j]->getStatus() == 1))
+            {
+                print("DATA", "Sharing layer " + std::to_string(j + 1));
+
+                layerSources[i] = j;
+                layersSwitching[i] = true;
+                return;
+            }
+        }
+
+        loadItem(i);
+    }
+
+    /**
+     * @brief Open the selected item of a layer on its standby player
+     *
+     * @param i The index of the layer
+     */
+    void loadItem(int i)
+    {
+        DataItem *item = selectedItems[i];
+
+        // Warm loaders are opened with the default threading, so layers with their own threading settings open the file themselves
+        VideoLoader *warmLoader = nullptr;
+
+        if (layerDecoderThreads[i] == 0 && !layerLowLatency[i])
+            warmLoader = prefetcher->take(item);
+
+        if (warmLoader != nullptr)
+        {
+            standbyPlayers[i]->adopt(warmLoader);
+            layersSwitching[i] = true;
+            return;
+        }
+
+        std::string scenePath = selectedItems[i]->getVideoPath();
 
         if (isVideoFile(scenePath.c_str()))
         {
-            videoLoaders[i]->loadVideo(scenePath.c_str());
+            standbyPlayers[i]->load(scenePath);
+            layersSwitching[i] = true;
         }
     }
 
+    /**
+     * @brief Make a layer show the frames of the layer it shares its item with, fading out from the item it showed before
+     *
+     * @param i The index of the layer
+     */
+    void followLayer(int i)
+    {
+        float duration = videoPlayers[i]->getStatus() == 1 ? parameters[Crossfade] : 0.0f;
+
+        // The item the layer showed fades out on the standby player, and the other player is not needed
+        std::swap(videoPlayers[i], standbyPlayers[i]);
+        videoPlayers[i]->unload();
+
+        viewerWindow->getViewerWidget()->crossfade(i, duration);
+        viewerWindow->getViewerWidget()->share(i, layerSources[i]);
+
+        layersSwitching[i] = false;
+        layersFading[i] = true;
+    }
+
+    /**
+     * @brief Check if a layer shares its item with other layers
+     *
+     * @param i The index of the layer
+     * @return true If the layer shows the frames of another layer, or another layer shows its frames
+     * @return false Otherwise
+     */
+    bool isShared(int i)
+    {
+        if (layerSources[i] >= 0)
+            return true;
+
+        for (int j = 0; j < layerSources.size(); j++)
+        {
+            if (layerSources[j] == i)
+                return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Stop a layer from sharing its item with other layers, before it plays something else
+     *
+     * The other layers play on undisturbed. A layer that showed the frames of another gets a copy of the frame on
+     * screen, and a layer whose frames others showed hands its player and texture over to one of them. Either way a
+     * layer that showed the shared item is left without a player, so it cuts to whatever it plays next.
+     *
+     * @param i The index of the layer
+     */
+    void splitLayer(int i)
+    {
+        if (layerSources[i] >= 0)
+        {
+            // A layer that is still waiting for the other one to show the item has nothing to copy
+            if (!layersSwitching[i])
+                viewerWindow->getViewerWidget()->unshare(i, false);
+
+            layerSources[i] = -1;
+            layersSwitching[i] = false;
+            return;
+        }
+
+        int heir = -1;
+
+        for (int j = 0; j < layerSources.size(); j++)
+        {
+            if (layerSources[j] != i)
+                continue;
+
+            if (layersSwitching[j])
+            {
+                // The item has not been shown yet, so the waiting layer opens it itself
+                layerSources[j] = -1;
+                layersSwitching[j] = false;
+                loadItem(j);
+            }
+            else if (heir < 0)
+            {
+                heir = j;
+                layerSources[j] = -1;
+
+                std::swap(videoPlayers[i], videoPlayers[j]);
+                viewerWindow->getViewerWidget()->unshare(j, true);
+            }
+            else
+            {
+                layerSources[j] = heir;
+                viewerWindow->getViewerWidget()->share(j, heir);
+            }
+        }
+    }
+
+    /**
+     * @brief Make the standby player of a layer the one it shows, fading out from the item it showed before
+     *
+     * @param i The index of the layer
+     */
+    void switchPlayers(int i)
+    {
+        // A layer that showed nothing, because it was just enabled, cuts to the new item
+        float duration = videoPlayers[i]->getStatus() == 1 ? parameters[Crossfade] : 0.0f;
+
+        std::swap(videoPlayers[i], standbyPlayers[i]);
+        viewerWindow->getViewerWidget()->crossfade(i, duration);
+
+        layersSwitching[i] = false;
+        layersFading[i] = true;
+    }
+
     /**
      * @brief Handle a parameter change
      *
@@ -309,8 +508,16 @@ protected:
      */
     void randomizeItem(int i)
     {
-        int randomIndex = std::rand() % selectedCategories[i]->items.size();
-        selectItem(i, selectedCategories[i]->items[randomIndex]);
+        // Prefer an item that has already been opened by the prefetcher
+        DataItem *item = prefetcher->pickWarm(selectedCategories[i]);
+
+        if (item == nullptr)
+        {
+            int randomIndex = std::rand() % selectedCategories[i]->items.size();
+            item = selectedCategories[i]->items[randomIndex];
+        }
+
+        selectItem(i, item);
     }
 
     /**
@@ -356,6 +563,66 @@ protected:
         if (parameters[OSCRetrigger3] != layerRetrigger[2])
             layerRetrigger[2] = parameters[OSCRetrigger3];
 
+        if (parameters[DecoderThreads1] != layerDecoderThreads[0])
+            layerDecoderThreads[0] = parameters[DecoderThreads1];
+
+        if (parameters[DecoderThreads2] != layerDecoderThreads[1])
+            layerDecoderThreads[1] = parameters[DecoderThreads2];
+
+        if (parameters[DecoderThreads3] != layerDecoderThreads[2])
+            layerDecoderThreads[2] = parameters[DecoderThreads3];
+
+        if (parameters[LowLatencyDecoding1] != layerLowLatency[0])
+            layerLowLatency[0] = parameters[LowLatencyDecoding1];
+
+        if (parameters[LowLatencyDecoding2] != layerLowLatency[1])
+            layerLowLatency[1] = parameters[LowLatencyDecoding2];
+
+        if (parameters[LowLatencyDecoding3] != layerLowLatency[2])
+            layerLowLatency[2] = parameters[LowLatencyDecoding3];
+
+        int enabledLayers = 0;
+
+        for (int i = 0; i < videoPlayers.size(); i++)
+        {
+            videoPlayers[i]->setThreading(layerDecoderThreads[i], layerLowLatency[i]);
+            videoPlayers[i]->setMemoryMapped(parameters[MemoryMappedReads]);
+            standbyPlayers[i]->setThreading(layerDecoderThreads[i], layerLowLatency[i]);
+            standbyPlayers[i]->setMemoryMapped(parameters[MemoryMappedReads]);
+            videoPlayers[i]->setAdaptiveQuality(parameters[AdaptiveQuality]);
+            standbyPlayers[i]->setAdaptiveQuality(parameters[AdaptiveQuality]);
+
+            // Disabling a layer returns its decoder to the pool, enabling it loads the selected item again
+            if (layersEnabled[i] != layersLoaded[i])
+            {
+                layersLoaded[i] = layersEnabled[i];
+
+                if (!layersEnabled[i])
+                {
+                    splitLayer(i);
+
+                    videoPlayers[i]->unload();
+                    standbyPlayers[i]->unload();
+                    viewerWindow->getViewerWidget()->clearLayer(i);
+
+                    layersSwitching[i] = false;
+                    layersFading[i] = false;
+                }
+                else if (selectedItems[i] != nullptr)
+                    selectItem(i, selectedItems[i]);
+            }
+
+            if (layersEnabled[i])
+                enabledLayers++;
+        }
+
+        DecoderThreadBudget::get().setConsumers(enabledLayers);
+        PacketCache::get().setMaxSize((size_t)parameters[PacketCacheSize] * 1024 * 1024);
+        PacketCache::get().setMaxClipSize((size_t)parameters[PacketCacheClipSize] * 1024 * 1024);
+        viewerWindow->getViewerWidget()->setMaxLoopMemory((size_t)parameters[GpuLoopMemory] * 1024 * 1024);
+        DecoderPool::get().setMaxDecoders(parameters[MaxDecoders]);
+        prefetcher->setMemoryMapped(parameters[MemoryMappedReads]);
+
         if (parameters[RandomizeCategory1] != pRandomizeCategory[0] && parameters[RandomizeCategory1])
         {
             pRandomizeCategory[0] = parameters[RandomizeCategory1];
@@ -447,32 +714,118 @@ protected:
                     print("OSC", "Received message for layer " + std::to_string(layer + 1));
                     selectCategory(layer, message.categories[0]);
                 }
+                else if (layerRetrigger[layer] && isShared(layer))
+                {
+                    // The layers it shares the item with play on, while this one opens it again from the start
+                    splitLayer(layer);
+                    loadItem(layer);
+                    layerStartTimes[layer] = getCurrentTime();
+                }
                 else if (layerRetrigger[layer])
                 {
-                    videoLoaders[layer]->rewind();
+                    videoPlayers[layer]->rewind();
+                    layerStartTimes[layer] = getCurrentTime();
                 }
             }
         }
 
+        if (allowOSC && oscServer->seekAvailable())
+        {
+            OSCSeek seek = oscServer->getSeek();
+
+            if (seek.layer >= 0 && seek.layer < videoPlayers.size() && layersEnabled[seek.layer])
+            {
+                if (isShared(seek.layer))
+                {
+                    // A seek right after the load makes it a start offset
+                    splitLayer(seek.layer);
+                    loadItem(seek.layer);
+                    standbyPlayers[seek.layer]->seek(int64_t(seek.time * 1000000));
+                }
+                else
+                {
+                    videoPlayers[seek.layer]->seek(int64_t(seek.time * 1000000));
+                }
+
+                // The playhead left the start, layers that select the item now open it themselves
+                layerStartTimes[seek.layer] = 0;
+            }
+        }
+
+        int targetWidth = 0;
+        int targetHeight = 0;
+
+        if (viewerWindow->getViewerWidget()->isInitialized())
+            viewerWindow->getViewerWidget()->getTargetSize(targetWidth, targetHeight);
+
+        prefetcher->setTargetSize(targetWidth, targetHeight);
+
         int64_t currentTime = getCurrentTime();
 
-        for (int i = 0; i < videoLoaders.size(); i++)
+        for (int i = 0; i < videoPlayers.size(); i++)
         {
             if (!layersEnabled[i])
             {
                 continue;
             }
 
-            VideoLoader *videoLoader = videoLoaders[i];
+            VideoFrameDescription vfd;
+
+            standbyPlayers[i]->setTargetSize(targetWidth, targetHeight);
+
+            // Loops the viewer holds are played by index, the outgoing item is held by the texture it fades out from
+            videoPlayers[i]->setResidentLoop(viewerWindow->getViewerWidget()->getResidentLoop(i));
+            standbyPlayers[i]->setResidentLoop(viewerWindow->getViewerWidget()->getResidentLoop(i, true));
 
-            if (videoLoader->getStatus() == 1 && videoLoader->shouldGetNextFrame(currentTime))
+            // The layer keeps showing its current item until the next one has a frame to show
+            if (layersSwitching[i] && layerSources[i] >= 0)
             {
-                VideoFrameDescription vfd = videoLoader->getFrame();
+                if (!layersSwitching[layerSources[i]])
+                    followLayer(i);
+            }
+            else if (layersSwitching[i] && standbyPlayers[i]->getStatus() == 1 && standbyPlayers[i]->getFrame(currentTime, vfd))
+            {
+                switchPlayers(i);
 
-                if (vfd.data != nullptr && vfd.ready)
+                if ((vfd.data != nullptr || vfd.loopFrame >= 0) && vfd.ready)
                 {
-                    viewerWindow->getViewerWidget()->setFrame(i, vfd.data, vfd.width, vfd.height, videoLoader->getColors());
+                    viewerWindow->getViewerWidget()->setFrame(i, vfd);
                 }
+
+                videoPlayers[i]->releaseFrame(vfd);
+            }
+            else if (layersFading[i] && !layersSwitching[i])
+            {
+                // The outgoing item keeps playing while it fades, and its decoder goes back to the pool afterwards
+                if (!viewerWindow->getViewerWidget()->isCrossfading(i))
+                {
+                    standbyPlayers[i]->unload();
+                    layersFading[i] = false;
+                }
+                else if (standbyPlayers[i]->getStatus() == 1 && standbyPlayers[i]->getFrame(currentTime, vfd))
+                {
+                    if ((vfd.data != nullptr || vfd.loopFrame >= 0) && vfd.ready)
+                    {
+                        viewerWindow->getViewerWidget()->setOutgoingFrame(i, vfd);
+                    }
+
+                    standbyPlayers[i]->releaseFrame(vfd);
+                }
+            }
+
+            VideoPlayer *videoPlayer = videoPlayers[i];
+
+            videoPlayer->setTargetSize(targetWidth, targetHeight);
+
+            if (videoPlayer->getStatus() == 1 && videoPlayer->getFrame(currentTime, vfd))
+            {
+                if ((vfd.data != nullptr || vfd.loopFrame >= 0) && vfd.ready)
+                {
+                    viewerWindow->getViewerWidget()->setFrame(i, vfd);
+                }
+
+                // The viewer takes over the reference to the frames it shows, so this only releases frames it did not take
+                videoPlayer->releaseFrame(vfd);
             }
         }
 
@@ -506,6 +859,11 @@ protected:
         if (ImGui::SliderFloat("Zoom", &parameters[Zoom], 0.0f, 1.0f))
             setParameterValue(Zoom, parameters[Zoom]);
 
+        ImGui::Text("Crossfade");
+        ImGui::SetNextItemWidth(width / 4);
+        if (ImGui::SliderFloat("Crossfade", &parameters[Crossfade], 0.0f, 2.0f, "%.2f s"))
+            setParameterValue(Crossfade, parameters[Crossfade]);
+
         ImGui::Text("Background Color");
         ImGui::SetNextItemWidth(width / 4);
         float hsv[3] = {parameters[BackgroundHue], parameters[BackgroundSaturation], parameters[BackgroundValue]};
@@ -521,6 +879,53 @@ protected:
         }
 
         ImGui::Toggle((std::string("OSC is ") + std::string(allowOSC ? "enabled" : "disabled")).c_str(), &allowOSC);
+
+        bool memoryMapped = parameters[MemoryMappedReads];
+        if (ImGui::Toggle("Memory Mapped Reads", &memoryMapped))
+        {
+            parameters[MemoryMappedReads] = memoryMapped;
+            setParameterValue(MemoryMappedReads, memoryMapped);
+        }
+
+        bool adaptiveQuality = parameters[AdaptiveQuality];
+        if (ImGui::Toggle("Adaptive Quality", &adaptiveQuality))
+        {
+            parameters[AdaptiveQuality] = adaptiveQuality;
+            setParameterValue(AdaptiveQuality, adaptiveQuality);
+        }
+
+        ImGui::Text("Packet Cache");
+        ImGui::SetNextItemWidth(width / 4);
+        if (ImGui::SliderFloat("Packet Cache", &parameters[PacketCacheSize], 0.0f, 2048.0f, "%.0f MB"))
+            setParameterValue(PacketCacheSize, parameters[PacketCacheSize]);
+
+        ImGui::Text("Packet Cache Clip Size");
+        ImGui::SetNextItemWidth(width / 4);
+        if (ImGui::SliderFloat("Packet Cache Clip Size", &parameters[PacketCacheClipSize], 0.0f, 256.0f, "%.0f MB"))
+            setParameterValue(PacketCacheClipSize, parameters[PacketCacheClipSize]);
+
+        ImGui::Text("GPU Loop Memory");
+        ImGui::SetNextItemWidth(width / 4);
+        if (ImGui::SliderFloat("GPU Loop Memory", &parameters[GpuLoopMemory], 0.0f, 2048.0f, "%.0f MB"))
+            setParameterValue(GpuLoopMemory, parameters[GpuLoopMemory]);
+
+        int maxDecoders = parameters[MaxDecoders];
+        ImGui::Text("Max Decoders");
+        ImGui::SetNextItemWidth(width / 4);
+        if (ImGui::SliderInt("Max Decoders", &maxDecoders, 1, 32))
+        {
+            parameters[MaxDecoders] = maxDecoders;
+            setParameterValue(MaxDecoders, maxDecoders);
+        }
+
+        int usedDecoders;
+        int openDecoders = DecoderPool::get().getOpenDecoders(usedDecoders);
+        ImGui::Text("%s", ("Decoders: " + std::to_string(usedDecoders) + " in use, " + std::to_string(openDecoders) + " open").c_str());
+
+        int cachedClips;
+        size_t cacheSize = PacketCache::get().getSize(cachedClips);
+        ImGui::Text("%s", ("Packet cache: " + std::to_string(cacheSize / (1024 * 1024)) + " MB in " + std::to_string(cachedClips) + " clips").c_str());
+        ImGui::Text("%s", ("GPU loops: " + std::to_string(viewerWindow->getViewerWidget()->getLoopMemory() / (1024 * 1024)) + " MB").c_str());
         ImGui::End();
 
         for (int i = 0; i < 3; i++)
@@ -601,6 +1006,50 @@ protected:
                     }
                 }
 
+                ImGui::Text("Decoder Threads (0 = auto)");
+                ImGui::SetNextItemWidth(width / 4);
+
+                if (ImGui::SliderInt(("Decoder Threads " + std::to_string(i + 1)).c_str(), &layerDecoderThreads[i], 0, 16))
+                {
+                    if (i == 0)
+                    {
+                        parameters[DecoderThreads1] = layerDecoderThreads[i];
+                        setParameterValue(DecoderThreads1, layerDecoderThreads[i]);
+                    }
+                    else if (i == 1)
+                    {
+                        parameters[DecoderThreads2] = layerDecoderThreads[i];
+                        setParameterValue(DecoderThreads2, layerDecoderThreads[i]);
+                    }
+                    else if (i == 2)
+                    {
+                        parameters[DecoderThreads3] = layerDecoderThreads[i];
+                        setParameterValue(DecoderThreads3, layerDecoderThreads[i]);
+                    }
+                }
+
+                bool lowLatency = layerLowLatency[i];
+                if (ImGui::Toggle((std::string("Low Latency Decoding ") + std::to_string(i + 1)).c_str(), &lowLatency))
+                {
+                    layerLowLatency[i] = lowLatency;
+
+                    if (i == 0)
+                    {
+                        parameters[LowLatencyDecoding1] = layerLowLatency[i];
+                        setParameterValue(LowLatencyDecoding1, layerLowLatency[i]);
+                    }
+                    else if (i == 1)
+                    {
+                        parameters[LowLatencyDecoding2] = layerLowLatency[i];
+                        setParameterValue(LowLatencyDecoding2, layerLowLatency[i]);
+                    }
+                    else if (i == 2)
+                    {
+                        parameters[LowLatencyDecoding3] = layerLowLatency[i];
+                        setParameterValue(LowLatencyDecoding3, layerLowLatency[i]);
+                    }
+                }
+
                 ImGui::Text("Category");
                 if (ImGui::BeginCombo(("Category " + std::to_string(i + 1)).c_str(), selectedCategories[i] != nullptr ? selectedCategories[i]->presentationName.c_str() : "None"))
                 {
@@ -641,7 +1090,27 @@ protected:
 
                 ImGui::TextWrapped(selectedItems[i] != nullptr ? selectedItems[i]->title.c_str() : "None");
 
-                std::vector<float> colors = videoLoaders[i]->getColors();
+                // The layer keeps playing its previous item while the next one is opened
+                if (layersSwitching[i] && layerSources[i] < 0 && standbyPlayers[i]->isLoading())
+                    ImGui::Text("Loading...");
+
+                // A layer that shares its item shows the timing and colors of the layer that decodes it
+                VideoPlayer *source = videoPlayers[i];
+
+                if (layerSources[i] >= 0)
+                {
+                    ImGui::Text("%s", ("Sharing layer " + std::to_string(layerSources[i] + 1)).c_str());
+                    source = videoPlayers[layerSources[i]];
+                }
+
+                char timing[64];
+                snprintf(timing, sizeof(timing), "Drift: %.1f ms, dropped %d", source->getDrift(), source->getDroppedFrames());
+                ImGui::Text("%s", timing);
+
+                // Decoding gets cheaper step by step when the layer cannot keep up
+                ImGui::Text("%s", (std::string("Quality: ") + QualityLadder::getName(source->getQuality())).c_str());
+
+                std::vector<float> colors = source->getColors();
 
                 if (colors.size() > 0)
                 {
@@ -680,15 +1149,26 @@ private:
 
     ImFont *regular; /**< The regular font */
 
-    std::vector<VideoLoader *> videoLoaders;        /**< The video loaders */
+    std::vector<VideoPlayer *> videoPlayers;        /**< The video players, one decode thread per layer */
+    std::vector<VideoPlayer *> standbyPlayers;      /**< The players each layer opens its next item on, and fades out from */
+    VideoPrefetcher *prefetcher;                    /**< Keeps upcoming items opened ahead of time */
     std::vector<DataCategory *> selectedCategories; /**< The selected categories */
     std::vector<DataItem *> selectedItems;          /**< The selected items */
 
     std::vector<bool> layersEnabled;       /**< Whether each layer is enabled */
     std::vector<bool> layerRetrigger;      /**< Whether each layer is retriggered on each note */
     std::vector<int> layerNotes;           /**< Which note each layer should respond to */
+    std::vector<int> layerDecoderThreads;  /**< How many decoder threads each layer requests, 0 for a fair share */
+    std::vector<bool> layerLowLatency;     /**< Whether each layer decodes with slice threading only */
+    std::vector<bool> layersLoaded;        /**< Whether each layer has its item loaded, which only enabled layers do */
+    std::vector<bool> layersSwitching;     /**< Whether each layer is waiting for its standby player to show a frame */
+    std::vector<bool> layersFading;        /**< Whether each layer is fading out from the item on its standby player */
+    std::vector<int> layerSources;         /**< The layer each layer shows the frames of because they play the same item, -1 for none */
+    std::vector<int64_t> layerStartTimes;  /**< When each layer last selected or retriggered its item, in microseconds */
     std::vector<std::string> lastMessages; /**< The last messages received */
 
+    static const int64_t shareWindow = 1000000 / 30; /**< How close together two layers must start an item to share it, one frame at 30 fps */
+
     /**
      * @brief Get the current time
      *
@@ -32,7 +32,14 @@ R""(
 
 uniform float focusAmount;
 uniform float blurSize;
-uniform sampler2D tex;
+uniform sampler2DArray tex;  // RGB, or the luma plane of YUV frames
+uniform sampler2DArray texU; // U plane, or the interleaved UV plane of NV12 frames
+uniform sampler2DArray texV; // V plane
+uniform float layer;         // Frame of a loop held on the GPU, 0 otherwise
+uniform int format;          // 0 = RGB, 1 = planar YUV 4:2:0, 2 = NV12
+uniform int bt709;
+uniform int fullRange;
+uniform float opacity;  // Below 1 while a layer fades between items
 uniform vec3[5] colors;
 uniform int colorIndex;
 uniform float time;
@@ -41,11 +48,38 @@ in vec2 v_texCoord;
 
 out vec4 color;
 
+vec3 sampleFrame(vec2 uv)
+{
+    if (format == 0) {
+        return texture(tex, vec3(uv, layer)).rgb;
+    }
+
+    float y = texture(tex, vec3(uv, layer)).r;
+    vec2 uv2 = format == 1 ? vec2(texture(texU, vec3(uv, layer)).r, texture(texV, vec3(uv, layer)).r) : texture(texU, vec3(uv, layer)).rg;
+
+    if (fullRange == 0) {
+        y = (y - 16.0 / 255.0) * (255.0 / 219.0);
+        uv2 = (uv2 - 128.0 / 255.0) * (255.0 / 224.0);
+    } else {
+        uv2 = uv2 - 128.0 / 255.0;
+    }
+
+    vec3 rgb;
+
+    if (bt709 == 1) {
+        rgb = vec3(y + 1.5748 * uv2.y, y - 0.1873 * uv2.x - 0.4681 * uv2.y, y + 1.8556 * uv2.x);
+    } else {
+        rgb = vec3(y + 1.402 * uv2.y, y - 0.3441 * uv2.x - 0.7141 * uv2.y, y + 1.772 * uv2.x);
+    }
+
+    return clamp(rgb, 0.0, 1.0);
+}
+
 void main()
 {
     vec2 random = vec2(random(v_texCoord.xy + fract(time)), random(v_texCoord.yx + fract(time))) * 2.0 - 1.0;
     
-    vec4 smpl = texture(tex, vec2(v_texCoord.x, 1.0 - v_texCoord.y) + random * blurSize * (1.0 - focusAmount));
+    vec3 smpl = sampleFrame(vec2(v_texCoord.x, 1.0 - v_texCoord.y) + random * blurSize * (1.0 - focusAmount));
 
     int closestIndex = 0;
     float closestDist = distance(smpl.xyz, colors[closestIndex]);
@@ -62,6 +96,6 @@ void main()
         discard;
     }
 
-    color = vec4(vec3(smpl.x, smpl.y, smpl.z), 1.0);
+    color = vec4(vec3(smpl.x, smpl.y, smpl.z), opacity);
 }
 )""
@@ -45,4 +45,11 @@ public:
 	std::string filename; /**< Filename of the item */
 
 	int sceneId; /**< Scene ID of the item */
+
+	/**
+	 * @brief Get the path to the video of the item, which is its proxy if one has been made with the tool
+	 *
+	 * @return std::string Path to the video
+	 */
+	std::string getVideoPath();
 };
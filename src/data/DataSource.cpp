@@ -17,8 +17,23 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "DataSource.hpp"
+#include <sys/stat.h>
 #include <string>
 
+std::string DataItem::getVideoPath()
+{
+	std::string original = source->path + "/items/" + filename + ".mp4";
+	std::string proxy = source->path + "/items/" + filename + ".proxy.mp4";
+
+	// Proxies are cheaper to decode, but an original that changed after its proxy was made takes precedence
+	struct stat originalInfo, proxyInfo;
+
+	if (stat(proxy.c_str(), &proxyInfo) == 0 && (stat(original.c_str(), &originalInfo) != 0 || proxyInfo.st_mtime >= originalInfo.st_mtime))
+		return proxy;
+
+	return original;
+}
+
 void DataSource::load(DataSources *sources)
 {
 	std::string dataPath = path + "/data.json";
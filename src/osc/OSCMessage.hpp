@@ -34,3 +34,14 @@ struct OSCMessage
 	int note;								/**< Note of the message */
 	bool seen;								/**< Whether the message has been seen */
 };
+
+/**
+ * @brief Stores an OSC seek request
+ *
+ */
+struct OSCSeek
+{
+	int layer;	/**< Index of the layer to seek, starting at 0 */
+	float time; /**< Time to seek to in seconds */
+	bool seen;	/**< Whether the request has been seen */
+};
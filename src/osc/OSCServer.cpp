@@ -62,6 +62,7 @@ public:
 	{
 		init(port);
 		latestMessage.seen = true;
+		latestSeek.seen = true;
 	}
 
 	~OSCServer()
@@ -147,6 +148,28 @@ public:
 		return latestMessage;
 	}
 
+	/**
+	 * @brief Whether a seek request is available
+	 *
+	 * @return true A seek request is available
+	 * @return false A seek request is not available
+	 */
+	bool seekAvailable()
+	{
+		return !latestSeek.seen;
+	}
+
+	/**
+	 * @brief Get the latest seek request
+	 *
+	 * @return OSCSeek The latest seek request
+	 */
+	OSCSeek getSeek()
+	{
+		latestSeek.seen = true;
+		return latestSeek;
+	}
+
 private:
 	/**
 	 * @brief Endlessly run the server (should be run in a separate thread)
@@ -220,6 +243,13 @@ private:
 								latestMessage.seen = false;
 							}
 						}
+						else if (address == "/WAIVE_Front/Seek" && format == "if")
+						{
+							// Layers are numbered from 1, like in the interface
+							latestSeek.layer = tosc_getNextInt32(&osc) - 1;
+							latestSeek.time = tosc_getNextFloat(&osc);
+							latestSeek.seen = false;
+						}
 					}
 				}
 			}
@@ -236,5 +266,6 @@ private:
 	std::thread thread; /**< The thread to run the server in */
 
 	OSCMessage latestMessage; /**< The latest message */
+	OSCSeek latestSeek;		  /**< The latest seek request */
 	DataSources *dataSources; /**< The data sources */
 };
@@ -25,6 +25,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <GL/glew.h>
 #endif
 
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
 /**
  * @brief Simple functions related to GLSL shader management, compilation and usage
  */
@@ -33,6 +41,7 @@ namespace Shader
 	/**
 	 * @brief A class to manage a texture in a shader program
 	 *
+	 * The texture is an array texture, so that it can hold every frame of a short loop. Single images use one layer.
 	 */
 	class ShaderTexture
 	{
@@ -53,12 +62,12 @@ namespace Shader
 			initialized = true;
 
 			glGenTextures(1, &texture);
-			glBindTexture(GL_TEXTURE_2D, texture);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
 
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
 			set(nullptr, 16, 16);
 		}
@@ -66,10 +75,12 @@ namespace Shader
 		/**
 		 * @brief Bind the texture to the current shader program
 		 *
+		 * @param unit The texture unit to bind the texture to
 		 */
-		void bind()
+		void bind(int unit = 0)
 		{
-			glBindTexture(GL_TEXTURE_2D, texture);
+			glActiveTexture(GL_TEXTURE0 + unit);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
 		}
 
 		/**
@@ -78,17 +89,77 @@ namespace Shader
 		 * @param data The texture data
 		 * @param width The width of the texture
 		 * @param height The height of the texture
+		 * @param stride The number of bytes per row of the data, 0 if the rows are tightly packed
+		 * @param channels The number of 8-bit channels per pixel, 1 (red), 2 (red and green) or 3 (RGB)
+		 * @param layer The layer to set
+		 * @param layers The number of layers of the texture storage
 		 */
-		void set(const unsigned char *data, int width, int height)
+		void set(const unsigned char *data, int width, int height, int stride = 0, int channels = 3, int layer = 0, int layers = 1)
 		{
+			static const GLenum formats[] = {GL_RED, GL_RG, GL_RGB};
+			static const GLint internalFormats[] = {GL_R8, GL_RG8, GL_RGB8};
+
 			bind();
 
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / channels);
+
+			// Only reallocate the texture storage when the dimensions or layout change
+			if (width != this->width || height != this->height || channels != this->channels || compressedFormat != 0 || layers != this->layers || data == nullptr)
+			{
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internalFormats[channels - 1], width, height, layers, 0, formats[channels - 1], GL_UNSIGNED_BYTE, nullptr);
+
+				this->width = width;
+				this->height = height;
+				this->channels = channels;
+				this->layers = layers;
+				compressedFormat = 0;
+			}
+
+			if (data != nullptr)
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, formats[channels - 1], GL_UNSIGNED_BYTE, data);
+
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+
+		/**
+		 * @brief Set the texture data from compressed blocks, which the GPU samples without decompressing them first
+		 *
+		 * @param data The blocks, tightly packed
+		 * @param width The width of the texture
+		 * @param height The height of the texture
+		 * @param size The size of the blocks in bytes
+		 * @param format The compressed format, GL_COMPRESSED_RGB_S3TC_DXT1_EXT or GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+		 * @param layer The layer to set
+		 * @param layers The number of layers of the texture storage
+		 */
+		void setCompressed(const unsigned char *data, int width, int height, int size, GLenum format, int layer = 0, int layers = 1)
+		{
+			bind();
+
+			if (width != this->width || height != this->height || format != compressedFormat || layers != this->layers)
+			{
+				glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, 0, format, width, height, layers, 0, size * layers, nullptr);
+
+				this->width = width;
+				this->height = height;
+				this->layers = layers;
+				channels = 0;
+				compressedFormat = format;
+			}
+
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, format, size, data);
 		}
 
 	private:
 		bool initialized = false; /**< Whether the texture has been initialized */
 
 		unsigned int texture; /**< The texture ID */
+		int width = 0;		  /**< The width of the texture storage */
+		int height = 0;		  /**< The height of the texture storage */
+		int channels = 0;	  /**< The number of channels of the texture storage */
+		int layers = 0;		  /**< The number of layers of the texture storage */
+		GLenum compressedFormat = 0; /**< The compressed format of the texture storage, 0 if it is not compressed */
 	};
 };
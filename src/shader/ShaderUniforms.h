@@ -38,6 +38,13 @@ namespace Shader
 		ShaderUniform<int> colorIndex = ShaderUniform<int>("colorIndex", 1);
 		ShaderUniform<float> size = ShaderUniform<float>("size", 1);
 		ShaderUniform<float> time = ShaderUniform<float>("time", 1);
+		ShaderUniform<int> texU = ShaderUniform<int>("texU", 1);
+		ShaderUniform<int> texV = ShaderUniform<int>("texV", 1);
+		ShaderUniform<int> format = ShaderUniform<int>("format", 1);
+		ShaderUniform<int> bt709 = ShaderUniform<int>("bt709", 1);
+		ShaderUniform<int> fullRange = ShaderUniform<int>("fullRange", 1);
+		ShaderUniform<float> opacity = ShaderUniform<float>("opacity", 1);
+		ShaderUniform<float> layer = ShaderUniform<float>("layer", 1);
 
 		void init(ShaderProgram *shaderProgram)
 		{
@@ -47,6 +54,13 @@ namespace Shader
 			colorIndex.find(shaderProgram->get());
 			size.find(shaderProgram->get());
 			time.find(shaderProgram->get());
+			texU.find(shaderProgram->get());
+			texV.find(shaderProgram->get());
+			format.find(shaderProgram->get());
+			bt709.find(shaderProgram->get());
+			fullRange.find(shaderProgram->get());
+			opacity.find(shaderProgram->get());
+			layer.find(shaderProgram->get());
 		}
 
 		void use()
@@ -57,6 +71,13 @@ namespace Shader
 			colorIndex.use();
 			size.use();
 			time.use();
+			texU.use();
+			texV.use();
+			format.use();
+			bt709.use();
+			fullRange.use();
+			opacity.use();
+			layer.use();
 		}
 	};
 };
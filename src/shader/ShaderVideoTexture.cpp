@@ -0,0 +1,159 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "ShaderTexture.cpp"
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Simple functions related to GLSL shader management, compilation and usage
+ */
+namespace Shader
+{
+	/**
+	 * @brief A video frame in a shader program, as a single RGB or block-compressed texture, or as YUV planes that the shader converts to RGB
+	 *
+	 * The planes can hold several frames in layers, so that a short loop can be played by only changing the layer.
+	 */
+	class ShaderVideoTexture
+	{
+	public:
+		int format = 0;	   /**< The layout of the planes: 0 for RGB, 1 for planar YUV 4:2:0, 2 for NV12 */
+		int bt709 = 0;	   /**< Whether YUV planes use BT.709 rather than BT.601 coefficients */
+		int fullRange = 0; /**< Whether YUV planes use the full 0-255 range rather than 16-235 */
+		float layer = 0;   /**< The layer to sample */
+
+		int loopClip = 0;			 /**< The loop whose frames the layers hold, 0 if they hold a single frame */
+		std::vector<bool> loopFrames; /**< Which frames of the loop have been set */
+		size_t loopSize = 0;		 /**< Size of the loop in GPU memory in bytes */
+
+		ShaderVideoTexture()
+		{
+		}
+
+		/**
+		 * @brief Initialize the plane textures
+		 *
+		 */
+		void init()
+		{
+			for (int i = 0; i < 3; i++)
+				planes[i].init();
+		}
+
+		/**
+		 * @brief Bind the plane textures to texture units 0, 1 and 2
+		 *
+		 */
+		void bind()
+		{
+			for (int i = 0; i < 3; i++)
+				planes[i].bind(i);
+
+			glActiveTexture(GL_TEXTURE0);
+		}
+
+		/**
+		 * @brief Set the frame data
+		 *
+		 * @param format The layout of the planes: 0 for RGB, 1 for planar YUV 4:2:0, 2 for NV12, 3 for BC1 and 4 for BC3 blocks
+		 * @param data The planes of the frame, only the first is used for RGB and blocks, and the first two for NV12
+		 * @param strides The number of bytes per row of each plane, or per row of blocks
+		 * @param width The width of the frame
+		 * @param height The height of the frame
+		 * @param layer The layer to set the frame in
+		 * @param layers The number of layers, which reallocates the planes when it changes
+		 */
+		void set(int format, unsigned char *const data[3], const int strides[3], int width, int height, int layer = 0, int layers = 1)
+		{
+			// Compressed textures sample as RGB, so the shader treats them as such
+			this->format = format >= 3 ? 0 : format;
+			this->layer = layer;
+
+			int chromaWidth = (width + 1) / 2;
+			int chromaHeight = (height + 1) / 2;
+
+			if (format >= 3)
+			{
+				GLenum compressedFormat = format == 3 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+				planes[0].setCompressed(data[0], width, height, strides[0] * ((height + 3) / 4), compressedFormat, layer, layers);
+			}
+			else if (format == 0)
+			{
+				planes[0].set(data[0], width, height, strides[0], 3, layer, layers);
+			}
+			else if (format == 1)
+			{
+				planes[0].set(data[0], width, height, strides[0], 1, layer, layers);
+				planes[1].set(data[1], chromaWidth, chromaHeight, strides[1], 1, layer, layers);
+				planes[2].set(data[2], chromaWidth, chromaHeight, strides[2], 1, layer, layers);
+			}
+			else
+			{
+				planes[0].set(data[0], width, height, strides[0], 1, layer, layers);
+				planes[1].set(data[1], chromaWidth, chromaHeight, strides[1], 2, layer, layers);
+			}
+		}
+
+		/**
+		 * @brief Get the GPU memory a single layer of the planes takes
+		 *
+		 * @param format The layout of the planes, as for set
+		 * @param width The width of the frame
+		 * @param height The height of the frame
+		 * @return size_t Size in bytes
+		 */
+		static size_t getLayerSize(int format, int width, int height)
+		{
+			size_t pixels = (size_t)width * height;
+			size_t chroma = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+			size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+
+			switch (format)
+			{
+			case 0:
+				return pixels * 3;
+			case 1:
+			case 2:
+				return pixels + chroma * 2;
+			case 3:
+				return blocks * 8;
+			default:
+				return blocks * 16;
+			}
+		}
+
+		/**
+		 * @brief Shrink the planes to a single empty layer, releasing the memory of the frames they held
+		 *
+		 */
+		void clear()
+		{
+			for (int i = 0; i < 3; i++)
+				planes[i].set(nullptr, 16, 16);
+
+			format = 0;
+			layer = 0;
+		}
+
+	private:
+		ShaderTexture planes[3]; /**< The textures of each plane */
+	};
+};
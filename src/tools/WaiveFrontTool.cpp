@@ -0,0 +1,1440 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavfilter/avfilter.h"
+#include "libavfilter/buffersink.h"
+#include "libavfilter/buffersrc.h"
+#include "libavformat/avformat.h"
+#include "libavutil/opt.h"
+#include "libswscale/swscale.h"
+}
+
+#include "../video/FrameConverter.cpp"
+#include "../video/HapUnpacker.cpp"
+#include "../video/PaletteCache.cpp"
+#include "../video/PaletteExtractor.cpp"
+#include "../util/Logger.cpp"
+using namespace Util::Logger;
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Offline preparation of the WAIVE library, so that the live show does not have to analyze anything
+ *
+ */
+namespace Tool
+{
+	/**
+	 * @brief Check if a file name ends with a suffix
+	 *
+	 * @param name File name
+	 * @param suffix Suffix to check for
+	 * @return true If the name ends with the suffix
+	 * @return false Otherwise
+	 */
+	static bool endsWith(const std::string &name, const std::string &suffix)
+	{
+		return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	/**
+	 * @brief List the entries of a directory, without . and ..
+	 *
+	 * @param directory Path to the directory
+	 * @return std::vector<std::string> Names of the entries
+	 */
+	static std::vector<std::string> listDirectory(const std::string &directory)
+	{
+		std::vector<std::string> names;
+		DIR *dir = opendir(directory.c_str());
+
+		if (dir == NULL)
+			return names;
+
+		struct dirent *entry;
+
+		while ((entry = readdir(dir)) != NULL)
+		{
+			std::string name = std::string(entry->d_name);
+
+			if (name != "." && name != "..")
+				names.push_back(name);
+		}
+
+		closedir(dir);
+
+		return names;
+	}
+
+	/**
+	 * @brief List the original videos of every data source in the library, without their proxies
+	 *
+	 * @param library Path to the library, usually ~/Documents/WAIVE
+	 * @return std::vector<std::string> Paths to the videos
+	 */
+	static std::vector<std::string> listVideos(const std::string &library)
+	{
+		std::vector<std::string> videos;
+
+		for (const std::string &source : listDirectory(library))
+		{
+			std::string items = library + "/" + source + "/items";
+
+			for (const std::string &name : listDirectory(items))
+			{
+				if (endsWith(name, ".mp4") && !endsWith(name, ".proxy.mp4"))
+					videos.push_back(items + "/" + name);
+			}
+		}
+
+		return videos;
+	}
+
+	/**
+	 * @brief Get the path of the proxy of a video, which DataItem::getVideoPath prefers over the original
+	 *
+	 * @param videoPath Path to the original video
+	 * @return std::string Path to the proxy
+	 */
+	static std::string getProxyPath(const std::string &videoPath)
+	{
+		return videoPath.substr(0, videoPath.size() - 4) + ".proxy.mp4";
+	}
+
+	/**
+	 * @brief Make the demuxer skip every stream but the video stream, instead of reading packets only to throw them away
+	 *
+	 * @param format The demuxer
+	 * @param streamIndex Index of the video stream
+	 */
+	static void discardOtherStreams(AVFormatContext *format, int streamIndex)
+	{
+		for (unsigned int i = 0; i < format->nb_streams; i++)
+			format->streams[i]->discard = (int)i == streamIndex ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+	}
+
+	/**
+	 * @brief Check if a video has a proxy that is at least as new as the video itself
+	 *
+	 * @param videoPath Path to the original video
+	 * @return true If the proxy is up to date
+	 * @return false If there is no proxy or the video changed after it was made
+	 */
+	static bool hasCurrentProxy(const std::string &videoPath)
+	{
+		struct stat videoInfo, proxyInfo;
+
+		if (stat(getProxyPath(videoPath).c_str(), &proxyInfo) != 0 || stat(videoPath.c_str(), &videoInfo) != 0)
+			return false;
+
+		return proxyInfo.st_mtime >= videoInfo.st_mtime;
+	}
+
+	/**
+	 * @brief Open a video and the decoder of its video stream, skipping the other streams
+	 *
+	 * @param videoPath Path to the video
+	 * @param format The demuxer, closed by the caller with avformat_close_input
+	 * @param context The decoder, freed by the caller with avcodec_free_context
+	 * @param streamIndex Index of the video stream
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	static int openVideo(const std::string &videoPath, AVFormatContext *&format, AVCodecContext *&context, int &streamIndex)
+	{
+		format = nullptr;
+		context = nullptr;
+
+		if (avformat_open_input(&format, videoPath.c_str(), nullptr, nullptr) < 0 || avformat_find_stream_info(format, nullptr) < 0)
+		{
+			error("TOOL", "Could not open " + videoPath);
+			avformat_close_input(&format);
+			return -1;
+		}
+
+		const AVCodec *codec = nullptr;
+		streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+
+		if (streamIndex < 0 || codec == nullptr)
+		{
+			error("TOOL", "Could not find a video stream in " + videoPath);
+			avformat_close_input(&format);
+			return -1;
+		}
+
+		discardOtherStreams(format, streamIndex);
+
+		context = avcodec_alloc_context3(codec);
+
+		if (context == nullptr || avcodec_parameters_to_context(context, format->streams[streamIndex]->codecpar) < 0 || avcodec_open2(context, codec, nullptr) < 0)
+		{
+			error("TOOL", "Could not open the decoder of " + videoPath);
+			avcodec_free_context(&context);
+			avformat_close_input(&format);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * @brief Decode a whole video and extract a palette every few frames
+	 *
+	 * @param videoPath Path to the video
+	 * @param every Number of frames between palettes
+	 * @param timeline Palettes ordered by time
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	static int computeTimeline(const std::string &videoPath, int every, std::vector<PaletteKeyframe> &timeline)
+	{
+		AVFormatContext *format;
+		AVCodecContext *context;
+		int streamIndex;
+
+		if (openVideo(videoPath, format, context, streamIndex) < 0)
+			return -1;
+
+		AVStream *stream = format->streams[streamIndex];
+		AVPacket *packet = av_packet_alloc();
+		AVFrame *frame = av_frame_alloc();
+		FrameConverter converter;
+		converter.setNativeYUV(true);
+
+		int frameIndex = 0;
+		bool draining = false;
+
+		while (true)
+		{
+			if (!draining)
+			{
+				if (av_read_frame(format, packet) < 0)
+				{
+					// Flush the frames the decoder still holds
+					draining = true;
+					avcodec_send_packet(context, nullptr);
+				}
+				else
+				{
+					if (packet->stream_index == streamIndex)
+						avcodec_send_packet(context, packet);
+
+					av_packet_unref(packet);
+				}
+			}
+
+			while (avcodec_receive_frame(context, frame) >= 0)
+			{
+				if (frameIndex++ % every == 0 && frame->best_effort_timestamp != AV_NOPTS_VALUE)
+				{
+					AVFrame *converted = nullptr;
+
+					if (converter.convert(frame, &converted) == 0)
+					{
+						VideoFrameDescription vfd;
+						FrameConverter::describe(converted, context->height, vfd);
+
+						PaletteKeyframe keyframe;
+						keyframe.time = av_rescale_q(frame->best_effort_timestamp, stream->time_base, AV_TIME_BASE_Q);
+						keyframe.colors = PaletteExtractor::extract(vfd);
+
+						if (keyframe.colors.size() > 0)
+							timeline.push_back(keyframe);
+
+						av_frame_free(&converted);
+					}
+				}
+
+				av_frame_unref(frame);
+			}
+
+			// Decode errors in the middle of a video only cost a frame, so only stop once the decoder is drained
+			if (draining)
+				break;
+		}
+
+		av_frame_free(&frame);
+		av_packet_free(&packet);
+		avcodec_free_context(&context);
+		avformat_close_input(&format);
+
+		// Frames come out in presentation order, but be safe with streams that have odd timestamps
+		std::sort(timeline.begin(), timeline.end(), [](const PaletteKeyframe &a, const PaletteKeyframe &b)
+				  { return a.time < b.time; });
+
+		return timeline.size() > 0 ? 0 : -1;
+	}
+
+	/**
+	 * @brief Compute the palette timeline of every video in the library
+	 *
+	 * Videos that have a proxy get the timeline of their proxy, since that is what will be played.
+	 *
+	 * @param library Path to the library
+	 * @param every Number of frames between palettes
+	 * @return int 0 if all videos were processed, 1 otherwise
+	 */
+	static int palettes(const std::string &library, int every)
+	{
+		std::vector<std::string> videos = listVideos(library);
+		int failed = 0;
+
+		for (std::string &video : videos)
+		{
+			if (hasCurrentProxy(video))
+				video = getProxyPath(video);
+		}
+
+		print("TOOL", "Computing palettes every " + std::to_string(every) + " frames for " + std::to_string(videos.size()) + " videos");
+
+		for (size_t i = 0; i < videos.size(); i++)
+		{
+			std::vector<PaletteKeyframe> timeline;
+
+			if (computeTimeline(videos[i], every, timeline) < 0)
+			{
+				failed++;
+				continue;
+			}
+
+			PaletteCache::storeTimeline(videos[i], timeline);
+			print("TOOL", "[" + std::to_string(i + 1) + "/" + std::to_string(videos.size()) + "] " + videos[i] + ": " + std::to_string(timeline.size()) + " palettes");
+		}
+
+		if (failed > 0)
+			warn("TOOL", std::to_string(failed) + " videos could not be processed");
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	/**
+	 * @brief Open an encoder for proxies, preferring short-GOP H.264 and falling back to intra-only MJPEG
+	 *
+	 * @param width Width of the proxy
+	 * @param height Height of the proxy
+	 * @param timeBase Time base of the frames that will be sent
+	 * @param frameRate Frame rate of the video
+	 * @param globalHeader Whether the muxer wants global headers
+	 * @return AVCodecContext* The encoder, or nullptr if neither could be opened
+	 */
+	static AVCodecContext *openProxyEncoder(int width, int height, AVRational timeBase, AVRational frameRate, bool globalHeader)
+	{
+		const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+		bool intraOnly = codec == nullptr;
+
+		if (intraOnly)
+			codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+
+		if (codec == nullptr)
+			return nullptr;
+
+		AVCodecContext *encoder = avcodec_alloc_context3(codec);
+
+		if (encoder == nullptr)
+			return nullptr;
+
+		encoder->width = width;
+		encoder->height = height;
+		encoder->time_base = timeBase;
+		encoder->framerate = frameRate;
+		encoder->sample_aspect_ratio = AVRational{1, 1};
+
+		if (intraOnly)
+		{
+			encoder->pix_fmt = AV_PIX_FMT_YUVJ420P;
+			encoder->flags |= AV_CODEC_FLAG_QSCALE;
+			encoder->global_quality = FF_QP2LAMBDA * 3;
+		}
+		else
+		{
+			// A keyframe every half second or so keeps seeking and retriggering cheap, without B-frames to reorder
+			encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+			encoder->gop_size = 12;
+			encoder->max_b_frames = 0;
+
+			av_opt_set(encoder->priv_data, "preset", "veryfast", 0);
+			av_opt_set(encoder->priv_data, "tune", "fastdecode", 0);
+			av_opt_set(encoder->priv_data, "crf", "18", 0);
+		}
+
+		if (globalHeader)
+			encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+		if (avcodec_open2(encoder, codec, nullptr) < 0)
+		{
+			avcodec_free_context(&encoder);
+			return nullptr;
+		}
+
+		return encoder;
+	}
+
+	/**
+	 * @brief Send a frame to the encoder and write the packets that come out of it
+	 *
+	 * @param encoder The encoder
+	 * @param output The muxer
+	 * @param outputStream The stream to write to
+	 * @param frame The frame, or nullptr to flush the encoder
+	 * @param packet Packet to receive into
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	static int encodeFrame(AVCodecContext *encoder, AVFormatContext *output, AVStream *outputStream, AVFrame *frame, AVPacket *packet)
+	{
+		if (avcodec_send_frame(encoder, frame) < 0)
+			return -1;
+
+		while (avcodec_receive_packet(encoder, packet) >= 0)
+		{
+			av_packet_rescale_ts(packet, encoder->time_base, outputStream->time_base);
+			packet->stream_index = outputStream->index;
+
+			if (av_interleaved_write_frame(output, packet) < 0)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * @brief Transcode a video into a proxy that is cheap to decode and quick to seek
+	 *
+	 * @param videoPath Path to the original video
+	 * @param proxyPath Path to write the proxy to
+	 * @param maxHeight Maximum height of the proxy, larger videos are scaled down
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	static int transcodeProxy(const std::string &videoPath, const std::string &proxyPath, int maxHeight)
+	{
+		AVFormatContext *input = nullptr;
+
+		if (avformat_open_input(&input, videoPath.c_str(), nullptr, nullptr) < 0 || avformat_find_stream_info(input, nullptr) < 0)
+		{
+			error("TOOL", "Could not open " + videoPath);
+			avformat_close_input(&input);
+			return -1;
+		}
+
+		const AVCodec *codec = nullptr;
+		int streamIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+
+		if (streamIndex < 0 || codec == nullptr)
+		{
+			error("TOOL", "Could not find a video stream in " + videoPath);
+			avformat_close_input(&input);
+			return -1;
+		}
+
+		discardOtherStreams(input, streamIndex);
+
+		AVStream *inputStream = input->streams[streamIndex];
+		AVCodecContext *decoder = avcodec_alloc_context3(codec);
+
+		if (decoder == nullptr || avcodec_parameters_to_context(decoder, inputStream->codecpar) < 0 || avcodec_open2(decoder, codec, nullptr) < 0)
+		{
+			error("TOOL", "Could not open the decoder of " + videoPath);
+			avcodec_free_context(&decoder);
+			avformat_close_input(&input);
+			return -1;
+		}
+
+		int height = std::min(decoder->height, maxHeight) & ~1;
+		int width = int(int64_t(decoder->width) * height / decoder->height) & ~1;
+
+		// Written under a temporary name, so that a half-written proxy is never picked up by the player
+		std::string partialPath = proxyPath + ".part";
+		AVFormatContext *output = nullptr;
+		AVCodecContext *encoder = nullptr;
+		AVStream *outputStream = nullptr;
+
+		if (avformat_alloc_output_context2(&output, nullptr, "mp4", partialPath.c_str()) >= 0)
+			encoder = openProxyEncoder(width, height, inputStream->time_base, av_guess_frame_rate(input, inputStream, nullptr), output->oformat->flags & AVFMT_GLOBALHEADER);
+
+		if (encoder != nullptr)
+			outputStream = avformat_new_stream(output, nullptr);
+
+		AVDictionary *options = nullptr;
+		av_dict_set(&options, "movflags", "faststart", 0);
+
+		bool opened = outputStream != nullptr &&
+					  avcodec_parameters_from_context(outputStream->codecpar, encoder) >= 0 &&
+					  avio_open(&output->pb, partialPath.c_str(), AVIO_FLAG_WRITE) >= 0;
+
+		if (opened)
+		{
+			outputStream->time_base = encoder->time_base;
+			opened = avformat_write_header(output, &options) >= 0;
+		}
+
+		av_dict_free(&options);
+
+		if (!opened)
+		{
+			error("TOOL", "Could not create " + partialPath);
+
+			if (output != nullptr && output->pb != nullptr)
+			{
+				avio_closep(&output->pb);
+				std::remove(partialPath.c_str());
+			}
+
+			avformat_free_context(output);
+			avcodec_free_context(&encoder);
+			avcodec_free_context(&decoder);
+			avformat_close_input(&input);
+			return -1;
+		}
+
+		AVPacket *packet = av_packet_alloc();
+		AVPacket *encoded = av_packet_alloc();
+		AVFrame *frame = av_frame_alloc();
+		AVFrame *scaled = av_frame_alloc();
+		SwsContext *scaler = nullptr;
+
+		scaled->width = width;
+		scaled->height = height;
+		scaled->format = encoder->pix_fmt;
+
+		int result = av_frame_get_buffer(scaled, 0) < 0 ? -1 : 0;
+		bool draining = false;
+
+		while (result == 0)
+		{
+			if (!draining)
+			{
+				if (av_read_frame(input, packet) < 0)
+				{
+					draining = true;
+					avcodec_send_packet(decoder, nullptr);
+				}
+				else
+				{
+					if (packet->stream_index == streamIndex)
+						avcodec_send_packet(decoder, packet);
+
+					av_packet_unref(packet);
+				}
+			}
+
+			while (result == 0 && avcodec_receive_frame(decoder, frame) >= 0)
+			{
+				scaler = sws_getCachedContext(scaler, frame->width, frame->height, (AVPixelFormat)frame->format, width, height, encoder->pix_fmt, SWS_BILINEAR, nullptr, nullptr, nullptr);
+
+				if (scaler == nullptr || av_frame_make_writable(scaled) < 0)
+				{
+					result = -1;
+					break;
+				}
+
+				sws_scale(scaler, frame->data, frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
+
+				// Keep the original timestamps, so that palette timelines and seeks line up with the original
+				scaled->pts = frame->best_effort_timestamp;
+
+				if (encodeFrame(encoder, output, outputStream, scaled, encoded) < 0)
+					result = -1;
+
+				av_frame_unref(frame);
+			}
+
+			if (draining)
+				break;
+		}
+
+		if (result == 0 && (encodeFrame(encoder, output, outputStream, nullptr, encoded) < 0 || av_write_trailer(output) < 0))
+			result = -1;
+
+		avio_closep(&output->pb);
+
+		// A stale proxy is replaced, which rename does not do by itself on Windows
+		if (result == 0)
+		{
+			std::remove(proxyPath.c_str());
+
+			if (std::rename(partialPath.c_str(), proxyPath.c_str()) != 0)
+				result = -1;
+		}
+
+		if (result != 0)
+		{
+			error("TOOL", "Could not transcode " + videoPath);
+			std::remove(partialPath.c_str());
+		}
+
+		sws_freeContext(scaler);
+		av_frame_free(&scaled);
+		av_frame_free(&frame);
+		av_packet_free(&encoded);
+		av_packet_free(&packet);
+		avformat_free_context(output);
+		avcodec_free_context(&encoder);
+		avcodec_free_context(&decoder);
+		avformat_close_input(&input);
+
+		return result;
+	}
+
+	/**
+	 * @brief Make a proxy of every video in the library that does not have an up to date one yet
+	 *
+	 * @param library Path to the library
+	 * @param maxHeight Maximum height of the proxies
+	 * @return int 0 if all videos were processed, 1 otherwise
+	 */
+	static int proxies(const std::string &library, int maxHeight)
+	{
+		std::vector<std::string> videos = listVideos(library);
+		int failed = 0;
+
+		print("TOOL", "Making proxies of at most " + std::to_string(maxHeight) + " pixels high for " + std::to_string(videos.size()) + " videos");
+
+		for (size_t i = 0; i < videos.size(); i++)
+		{
+			std::string progress = "[" + std::to_string(i + 1) + "/" + std::to_string(videos.size()) + "] " + videos[i];
+
+			if (hasCurrentProxy(videos[i]))
+			{
+				print("TOOL", progress + ": proxy is up to date");
+				continue;
+			}
+
+			if (transcodeProxy(videos[i], getProxyPath(videos[i]), maxHeight) < 0)
+			{
+				failed++;
+				continue;
+			}
+
+			print("TOOL", progress + ": done");
+		}
+
+		if (failed > 0)
+			warn("TOOL", std::to_string(failed) + " videos could not be processed");
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	/**
+	 * @brief Time reading every packet of the video stream of a video, the way the player reads it
+	 *
+	 * @param videoPath Path to the video
+	 * @param discard Whether the demuxer skips the other streams
+	 * @param streams Number of streams in the video
+	 * @return double Time in milliseconds, or a negative value on error
+	 */
+	static double timeDemux(const std::string &videoPath, bool discard, int &streams)
+	{
+		AVFormatContext *format = nullptr;
+
+		if (avformat_open_input(&format, videoPath.c_str(), nullptr, nullptr) < 0 || avformat_find_stream_info(format, nullptr) < 0)
+		{
+			error("TOOL", "Could not open " + videoPath);
+			avformat_close_input(&format);
+			return -1.0;
+		}
+
+		int streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+		streams = format->nb_streams;
+
+		if (streamIndex < 0)
+		{
+			error("TOOL", "Could not find a video stream in " + videoPath);
+			avformat_close_input(&format);
+			return -1.0;
+		}
+
+		if (discard)
+			discardOtherStreams(format, streamIndex);
+
+		AVPacket *packet = av_packet_alloc();
+		auto start = std::chrono::steady_clock::now();
+
+		while (packet != nullptr && av_read_frame(format, packet) >= 0)
+			av_packet_unref(packet);
+
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		av_packet_free(&packet);
+		avformat_close_input(&format);
+
+		return elapsed;
+	}
+
+	/**
+	 * @brief Measure how much skipping the streams that are not played saves when reading the videos of the library
+	 *
+	 * Every video is read once beforehand, so that both measurements read it from the file cache.
+	 *
+	 * @param library Path to the library
+	 * @return int 0 if all videos were read, 1 otherwise
+	 */
+	static int demux(const std::string &library)
+	{
+		std::vector<std::string> videos = listVideos(library);
+		double totalAll = 0.0;
+		double totalVideo = 0.0;
+		int failed = 0;
+
+		for (size_t i = 0; i < videos.size(); i++)
+		{
+			int streams = 0;
+			timeDemux(videos[i], false, streams);
+
+			double all = timeDemux(videos[i], false, streams);
+			double video = timeDemux(videos[i], true, streams);
+
+			if (all < 0.0 || video < 0.0)
+			{
+				failed++;
+				continue;
+			}
+
+			totalAll += all;
+			totalVideo += video;
+
+			char timing[64];
+			snprintf(timing, sizeof(timing), "%d streams, %.1f ms, %.1f ms video only", streams, all, video);
+			print("TOOL", "[" + std::to_string(i + 1) + "/" + std::to_string(videos.size()) + "] " + videos[i] + ": " + timing);
+		}
+
+		char total[64];
+		snprintf(total, sizeof(total), "%.1f ms, %.1f ms video only", totalAll, totalVideo);
+		print("TOOL", "Total: " + std::string(total));
+
+		if (failed > 0)
+			warn("TOOL", std::to_string(failed) + " videos could not be read");
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	/**
+	 * @brief Read every packet of the video stream of a video into memory
+	 *
+	 * @param format The demuxer
+	 * @param streamIndex Index of the video stream
+	 * @param packets The packets, freed by the caller
+	 */
+	static void readPackets(AVFormatContext *format, int streamIndex, std::vector<AVPacket *> &packets)
+	{
+		AVPacket *packet = av_packet_alloc();
+
+		while (packet != nullptr && av_read_frame(format, packet) >= 0)
+		{
+			if (packet->stream_index == streamIndex)
+			{
+				packets.push_back(packet);
+				packet = av_packet_alloc();
+			}
+			else
+				av_packet_unref(packet);
+		}
+
+		av_packet_free(&packet);
+	}
+
+	/**
+	 * @brief Send a packet to the decoder and count the frames that come out of it, without losing the packet when the decoder is full
+	 *
+	 * @param context The decoder
+	 * @param packet The packet, or nullptr to drain the decoder
+	 * @param frame Frame to receive into
+	 * @param frames Incremented for every frame received
+	 */
+	static void decodePacket(AVCodecContext *context, const AVPacket *packet, AVFrame *frame, int &frames)
+	{
+		int ret;
+
+		do
+		{
+			ret = avcodec_send_packet(context, packet);
+
+			while (avcodec_receive_frame(context, frame) >= 0)
+			{
+				frames++;
+				av_frame_unref(frame);
+			}
+		} while (ret == AVERROR(EAGAIN));
+	}
+
+	/**
+	 * @brief Decode packets from memory, either sending them straight to the decoder or running them through a parser first
+	 *
+	 * @param context The decoder, flushed before decoding
+	 * @param packets Packets of the video stream
+	 * @param parse Whether to run the packets through a parser, as the player did before it sent them directly
+	 * @param frames Number of frames decoded
+	 * @return double Time in milliseconds, or a negative value on error
+	 */
+	static double timeDecode(AVCodecContext *context, const std::vector<AVPacket *> &packets, bool parse, int &frames)
+	{
+		AVCodecParserContext *parser = parse ? av_parser_init(context->codec_id) : nullptr;
+		AVPacket *parsed = av_packet_alloc();
+		AVFrame *frame = av_frame_alloc();
+
+		if ((parse && parser == nullptr) || parsed == nullptr || frame == nullptr)
+		{
+			av_parser_close(parser);
+			av_packet_free(&parsed);
+			av_frame_free(&frame);
+			return -1.0;
+		}
+
+		avcodec_flush_buffers(context);
+		frames = 0;
+
+		auto start = std::chrono::steady_clock::now();
+
+		for (size_t i = 0; i <= packets.size(); i++)
+		{
+			if (parser == nullptr)
+				decodePacket(context, i < packets.size() ? packets[i] : nullptr, frame, frames);
+			else
+			{
+				// The last pass flushes the parser, after which the decoder is drained
+				const AVPacket *packet = i < packets.size() ? packets[i] : nullptr;
+				const uint8_t *data = packet != nullptr ? packet->data : nullptr;
+				int dataSize = packet != nullptr ? packet->size : 0;
+
+				do
+				{
+					int ret = av_parser_parse2(parser, context, &parsed->data, &parsed->size, data, dataSize,
+											   packet != nullptr ? packet->pts : AV_NOPTS_VALUE,
+											   packet != nullptr ? packet->dts : AV_NOPTS_VALUE,
+											   packet != nullptr ? packet->pos : -1);
+
+					if (ret < 0)
+						break;
+
+					data += ret;
+					dataSize -= ret;
+
+					// The parsed data lives in the parser's buffer, so the decoder has to copy it
+					if (parsed->size > 0)
+					{
+						parsed->pts = parser->pts;
+						parsed->dts = parser->dts;
+						decodePacket(context, parsed, frame, frames);
+					}
+				} while (dataSize > 0);
+
+				if (packet == nullptr)
+					decodePacket(context, nullptr, frame, frames);
+			}
+		}
+
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		av_parser_close(parser);
+		av_packet_free(&parsed);
+		av_frame_free(&frame);
+
+		return elapsed;
+	}
+
+	/**
+	 * @brief Measure how much sending demuxed packets straight to the decoder saves over parsing them first
+	 *
+	 * The packets of each video are read into memory first, so that only the decoding path is timed.
+	 *
+	 * @param library Path to the library
+	 * @return int 0 if all videos were decoded, 1 otherwise
+	 */
+	static int parse(const std::string &library)
+	{
+		std::vector<std::string> videos = listVideos(library);
+		double totalDirect = 0.0;
+		double totalParsed = 0.0;
+		int failed = 0;
+
+		for (size_t i = 0; i < videos.size(); i++)
+		{
+			AVFormatContext *format;
+			AVCodecContext *context;
+			int streamIndex;
+
+			if (openVideo(videos[i], format, context, streamIndex) < 0)
+			{
+				failed++;
+				continue;
+			}
+
+			std::vector<AVPacket *> packets;
+			readPackets(format, streamIndex, packets);
+
+			int directFrames = 0, parsedFrames = 0;
+			double direct = timeDecode(context, packets, false, directFrames);
+			double parsed = timeDecode(context, packets, true, parsedFrames);
+
+			for (AVPacket *packet : packets)
+				av_packet_free(&packet);
+
+			avcodec_free_context(&context);
+			avformat_close_input(&format);
+
+			if (direct < 0.0 || parsed < 0.0)
+			{
+				error("TOOL", "Could not decode " + videos[i]);
+				failed++;
+				continue;
+			}
+
+			// Both paths should give the same frames, otherwise the timings do not compare the same work
+			if (directFrames != parsedFrames)
+				warn("TOOL", videos[i] + ": " + std::to_string(directFrames) + " frames sent directly, " + std::to_string(parsedFrames) + " frames parsed");
+
+			totalDirect += direct;
+			totalParsed += parsed;
+
+			char timing[96];
+			snprintf(timing, sizeof(timing), "%zu packets, %.1f ms, %.1f ms parsed", packets.size(), direct, parsed);
+			print("TOOL", "[" + std::to_string(i + 1) + "/" + std::to_string(videos.size()) + "] " + videos[i] + ": " + timing);
+		}
+
+		char total[64];
+		snprintf(total, sizeof(total), "%.1f ms, %.1f ms parsed", totalDirect, totalParsed);
+		print("TOOL", "Total: " + std::string(total));
+
+		if (failed > 0)
+			warn("TOOL", std::to_string(failed) + " videos could not be decoded");
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	/**
+	 * @brief Decode the first frame of a video, which is the frame the player takes the palette from
+	 *
+	 * @param videoPath Path to the video
+	 * @return AVFrame* The frame, freed by the caller, or nullptr on error
+	 */
+	static AVFrame *decodeFirstFrame(const std::string &videoPath)
+	{
+		AVFormatContext *format;
+		AVCodecContext *context;
+		int streamIndex;
+
+		if (openVideo(videoPath, format, context, streamIndex) < 0)
+			return nullptr;
+
+		AVPacket *packet = av_packet_alloc();
+		AVFrame *frame = av_frame_alloc();
+		bool decoded = false;
+		bool draining = false;
+
+		while (!decoded && packet != nullptr && frame != nullptr)
+		{
+			if (!draining)
+			{
+				if (av_read_frame(format, packet) < 0)
+				{
+					draining = true;
+					avcodec_send_packet(context, nullptr);
+				}
+				else
+				{
+					if (packet->stream_index == streamIndex)
+						avcodec_send_packet(context, packet);
+
+					av_packet_unref(packet);
+				}
+			}
+
+			decoded = avcodec_receive_frame(context, frame) >= 0;
+
+			if (draining)
+				break;
+		}
+
+		if (!decoded)
+			av_frame_free(&frame);
+
+		av_packet_free(&packet);
+		avcodec_free_context(&context);
+		avformat_close_input(&format);
+
+		return frame;
+	}
+
+	/**
+	 * @brief Extract a palette with the palettegen filter graph, the way the player did before PaletteExtractor
+	 *
+	 * The graph is built for every frame, as the player built one for every load.
+	 *
+	 * @param rgb Frame in RGB24
+	 * @param colors RGB triplets from 0 to 1, in the order palettegen gives them
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	static int palettegen(AVFrame *rgb, std::vector<float> &colors)
+	{
+		AVFilterGraph *graph = avfilter_graph_alloc();
+		AVFilterContext *source = nullptr, *sink = nullptr;
+		AVFilterInOut *outputs = avfilter_inout_alloc();
+		AVFilterInOut *inputs = avfilter_inout_alloc();
+		AVFrame *palette = av_frame_alloc();
+
+		char args[256];
+		snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/1:pixel_aspect=1/1", rgb->width, rgb->height, AV_PIX_FMT_RGB24);
+
+		enum AVPixelFormat formats[] = {AV_PIX_FMT_RGB32, AV_PIX_FMT_NONE};
+
+		int ret = graph != nullptr && outputs != nullptr && inputs != nullptr && palette != nullptr ? 0 : -1;
+
+		if (ret >= 0)
+			ret = avfilter_graph_create_filter(&source, avfilter_get_by_name("buffer"), "in", args, nullptr, graph);
+
+		if (ret >= 0)
+			ret = avfilter_graph_create_filter(&sink, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr, graph);
+
+		if (ret >= 0)
+			ret = av_opt_set_int_list(sink, "pix_fmts", formats, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+
+		if (ret >= 0)
+		{
+			outputs->name = av_strdup("in");
+			outputs->filter_ctx = source;
+			outputs->pad_idx = 0;
+			outputs->next = nullptr;
+
+			inputs->name = av_strdup("out");
+			inputs->filter_ctx = sink;
+			inputs->pad_idx = 0;
+			inputs->next = nullptr;
+
+			ret = avfilter_graph_parse_ptr(graph, "palettegen=max_colors=5", &inputs, &outputs, nullptr);
+		}
+
+		if (ret >= 0)
+			ret = avfilter_graph_config(graph, nullptr);
+
+		if (ret >= 0)
+			ret = av_buffersrc_add_frame_flags(source, rgb, AV_BUFFERSRC_FLAG_KEEP_REF);
+
+		if (ret >= 0)
+			ret = av_buffersrc_add_frame_flags(source, nullptr, 0);
+
+		if (ret >= 0)
+			ret = av_buffersink_get_frame(sink, palette);
+
+		if (ret >= 0)
+		{
+			const uint32_t *entries = (const uint32_t *)palette->data[0];
+
+			colors.clear();
+
+			for (int i = 0; i < 5; i++)
+			{
+				colors.push_back(((entries[i] >> 16) & 0xFF) / 255.0f);
+				colors.push_back(((entries[i] >> 8) & 0xFF) / 255.0f);
+				colors.push_back((entries[i] & 0xFF) / 255.0f);
+			}
+		}
+
+		av_frame_free(&palette);
+		avfilter_inout_free(&inputs);
+		avfilter_inout_free(&outputs);
+		avfilter_graph_free(&graph);
+
+		return ret >= 0 ? 0 : -1;
+	}
+
+	/**
+	 * @brief Measure how far apart two palettes are, regardless of the order of their colors
+	 *
+	 * @param a RGB triplets from 0 to 1
+	 * @param b RGB triplets from 0 to 1
+	 * @return double Mean distance from each color to the closest color of the other palette, in 8-bit RGB units
+	 */
+	static double paletteDistance(const std::vector<float> &a, const std::vector<float> &b)
+	{
+		double total = 0.0;
+		int count = 0;
+
+		for (int pass = 0; pass < 2; pass++)
+		{
+			const std::vector<float> &from = pass == 0 ? a : b;
+			const std::vector<float> &to = pass == 0 ? b : a;
+
+			for (size_t i = 0; i + 2 < from.size(); i += 3)
+			{
+				double closest = -1.0;
+
+				for (size_t j = 0; j + 2 < to.size(); j += 3)
+				{
+					double dr = from[i] - to[j], dg = from[i + 1] - to[j + 1], db = from[i + 2] - to[j + 2];
+					double distance = std::sqrt(dr * dr + dg * dg + db * db);
+
+					if (closest < 0.0 || distance < closest)
+						closest = distance;
+				}
+
+				if (closest >= 0.0)
+				{
+					total += closest;
+					count++;
+				}
+			}
+		}
+
+		return count > 0 ? 255.0 * total / count : 0.0;
+	}
+
+	/**
+	 * @brief Compare PaletteExtractor with the palettegen filter graph it replaced, on the first frame of every video
+	 *
+	 * PaletteExtractor is timed on the frame as the player hands it to the viewer. The palettegen path is timed from
+	 * the decoded frame, including the conversion to full-size RGB it needed.
+	 *
+	 * @param library Path to the library
+	 * @return int 0 if all videos were compared, 1 otherwise
+	 */
+	static int palette(const std::string &library)
+	{
+		static const int runs = 20;
+
+		std::vector<std::string> videos = listVideos(library);
+		double totalExtractor = 0.0;
+		double totalPalettegen = 0.0;
+		double totalDistance = 0.0;
+		int compared = 0;
+		int failed = 0;
+
+		FrameConverter viewerConverter;
+		viewerConverter.setNativeYUV(true);
+		FrameConverter rgbConverter;
+
+		for (size_t i = 0; i < videos.size(); i++)
+		{
+			AVFrame *frame = decodeFirstFrame(videos[i]);
+			AVFrame *displayed = nullptr;
+
+			if (frame == nullptr || viewerConverter.convert(frame, &displayed) < 0)
+			{
+				av_frame_free(&frame);
+				failed++;
+				continue;
+			}
+
+			VideoFrameDescription vfd;
+			FrameConverter::describe(displayed, frame->height, vfd);
+
+			std::vector<float> extracted;
+			auto start = std::chrono::steady_clock::now();
+
+			for (int run = 0; run < runs; run++)
+				extracted = PaletteExtractor::extract(vfd);
+
+			double extractor = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+
+			std::vector<float> generated;
+			bool generatedAll = true;
+			start = std::chrono::steady_clock::now();
+
+			for (int run = 0; run < runs && generatedAll; run++)
+			{
+				AVFrame *rgb = nullptr;
+				generatedAll = rgbConverter.convert(frame, &rgb) == 0 && palettegen(rgb, generated) == 0;
+				av_frame_free(&rgb);
+			}
+
+			double filter = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+
+			av_frame_free(&displayed);
+			av_frame_free(&frame);
+
+			if (extracted.size() == 0 || !generatedAll)
+			{
+				error("TOOL", "Could not extract the palette of " + videos[i]);
+				failed++;
+				continue;
+			}
+
+			double distance = paletteDistance(extracted, generated);
+
+			totalExtractor += extractor;
+			totalPalettegen += filter;
+			totalDistance += distance;
+			compared++;
+
+			char result[96];
+			snprintf(result, sizeof(result), "%.3f ms, %.3f ms palettegen, distance %.1f", extractor, filter, distance);
+			print("TOOL", "[" + std::to_string(i + 1) + "/" + std::to_string(videos.size()) + "] " + videos[i] + ": " + result);
+		}
+
+		if (compared > 0)
+		{
+			char total[96];
+			snprintf(total, sizeof(total), "%.3f ms, %.3f ms palettegen, distance %.1f", totalExtractor / compared, totalPalettegen / compared, totalDistance / compared);
+			print("TOOL", "Mean: " + std::string(total));
+		}
+
+		if (failed > 0)
+			warn("TOOL", std::to_string(failed) + " videos could not be compared");
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	/**
+	 * @brief Check the HAP unpacker against FFmpeg's hap decoder on every frame of a video
+	 *
+	 * Every pixel decoded from the unpacked blocks is compared with the pixel FFmpeg decodes. FFmpeg rounds where the
+	 * unpacker truncates when it expands and interpolates the endpoint colors, so channels may differ by a small amount.
+	 * Every packet is also unpacked with its last byte cut off, which has to be rejected.
+	 *
+	 * @param videoPath Path to the video
+	 * @param format FrameFormatBC1 or FrameFormatBC3
+	 * @param frames Number of frames checked
+	 * @param maxDifference Largest difference of a channel between the two decoders
+	 * @return int 0 if every frame matched, -1 otherwise
+	 */
+	static int checkHap(const std::string &videoPath, int format, int &frames, int &maxDifference)
+	{
+		static const int tolerance = 4;
+
+		AVFormatContext *input;
+		AVCodecContext *context;
+		int streamIndex;
+
+		frames = 0;
+		maxDifference = 0;
+
+		if (openVideo(videoPath, input, context, streamIndex) < 0)
+			return -1;
+
+		int width = context->width;
+		int height = context->height;
+		int stride = HapUnpacker::getStride(format, width);
+		std::vector<uint8_t> blocks(HapUnpacker::getSize(format, width, height));
+
+		AVPacket *packet = av_packet_alloc();
+		AVFrame *frame = av_frame_alloc();
+		int result = packet != nullptr && frame != nullptr ? 0 : -1;
+
+		while (result == 0 && av_read_frame(input, packet) >= 0)
+		{
+			if (packet->stream_index != streamIndex)
+			{
+				av_packet_unref(packet);
+				continue;
+			}
+
+			if (HapUnpacker::unpack(packet->data, packet->size, blocks.data(), blocks.size()) < 0)
+			{
+				error("TOOL", videoPath + ": could not unpack frame " + std::to_string(frames));
+				result = -1;
+			}
+			else if (packet->size > 0 && HapUnpacker::unpack(packet->data, packet->size - 1, blocks.data(), blocks.size()) == 0)
+			{
+				error("TOOL", videoPath + ": accepted truncated frame " + std::to_string(frames));
+				result = -1;
+			}
+
+			// HAP frames are intra-only, so every packet gives exactly one frame
+			if (result == 0 && (avcodec_send_packet(context, packet) < 0 || avcodec_receive_frame(context, frame) < 0))
+			{
+				error("TOOL", videoPath + ": FFmpeg could not decode frame " + std::to_string(frames));
+				result = -1;
+			}
+
+			av_packet_unref(packet);
+
+			if (result != 0)
+				break;
+
+			// FFmpeg decodes HAP to 4 bytes per pixel, RGB0 or RGBA
+			for (int y = 0; y < height; y++)
+			{
+				const uint8_t *row = frame->data[0] + (size_t)y * frame->linesize[0];
+
+				for (int x = 0; x < width; x++)
+				{
+					uint32_t pixel = HapUnpacker::decodePixel(blocks.data(), stride, format, x, y);
+
+					for (int c = 0; c < 3; c++)
+						maxDifference = std::max(maxDifference, std::abs(int((pixel >> (8 * c)) & 0xFF) - int(row[4 * x + c])));
+				}
+			}
+
+			av_frame_unref(frame);
+			frames++;
+
+			if (maxDifference > tolerance)
+			{
+				error("TOOL", videoPath + ": frame " + std::to_string(frames - 1) + " differs from FFmpeg by " + std::to_string(maxDifference));
+				result = -1;
+			}
+		}
+
+		av_frame_free(&frame);
+		av_packet_free(&packet);
+		avcodec_free_context(&context);
+		avformat_close_input(&input);
+
+		return result;
+	}
+
+	/**
+	 * @brief Get the block format a video would be played with, by probing its first packet like the player does
+	 *
+	 * @param videoPath Path to the video
+	 * @return int FrameFormatBC1 or FrameFormatBC3, or -1 if it is not a HAP video that is unpacked
+	 */
+	static int probeHap(const std::string &videoPath)
+	{
+		AVFormatContext *input = nullptr;
+
+		if (avformat_open_input(&input, videoPath.c_str(), nullptr, nullptr) < 0 || avformat_find_stream_info(input, nullptr) < 0)
+		{
+			avformat_close_input(&input);
+			return -1;
+		}
+
+		int streamIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+		int format = -1;
+
+		if (streamIndex >= 0 && input->streams[streamIndex]->codecpar->codec_id == AV_CODEC_ID_HAP)
+		{
+			AVPacket *packet = av_packet_alloc();
+
+			while (packet != nullptr && av_read_frame(input, packet) >= 0)
+			{
+				bool isVideo = packet->stream_index == streamIndex;
+
+				if (isVideo)
+					format = HapUnpacker::probe(packet->data, packet->size);
+
+				av_packet_unref(packet);
+
+				if (isVideo)
+					break;
+			}
+
+			av_packet_free(&packet);
+		}
+
+		avformat_close_input(&input);
+
+		return format;
+	}
+
+	/**
+	 * @brief Check the HAP unpacker on every HAP video in the library, without needing a GPU
+	 *
+	 * @param library Path to the library
+	 * @return int 0 if every HAP video matched FFmpeg, 1 otherwise
+	 */
+	static int hap(const std::string &library)
+	{
+		std::vector<std::string> videos = listVideos(library);
+		int checked = 0;
+		int failed = 0;
+
+		for (std::string &video : videos)
+		{
+			if (hasCurrentProxy(video))
+				video = getProxyPath(video);
+		}
+
+		for (size_t i = 0; i < videos.size(); i++)
+		{
+			int format = probeHap(videos[i]);
+
+			if (format < 0)
+				continue;
+
+			int frames, maxDifference;
+			checked++;
+
+			if (checkHap(videos[i], format, frames, maxDifference) < 0)
+			{
+				failed++;
+				continue;
+			}
+
+			print("TOOL", "[" + std::to_string(i + 1) + "/" + std::to_string(videos.size()) + "] " + videos[i] + ": " +
+							  (format == FrameFormatBC1 ? "BC1, " : "BC3, ") + std::to_string(frames) + " frames, largest difference " + std::to_string(maxDifference));
+		}
+
+		print("TOOL", std::to_string(checked) + " HAP videos checked");
+
+		if (failed > 0)
+			warn("TOOL", std::to_string(failed) + " HAP videos did not match");
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	/**
+	 * @brief Print how to use the tool
+	 *
+	 */
+	static void usage()
+	{
+		print("TOOL", "Usage: WAIVE-FRONT-V2-tool palettes <library> [frames between palettes, default 15]");
+		print("TOOL", "       WAIVE-FRONT-V2-tool proxies <library> [maximum height, default 720]");
+		print("TOOL", "       WAIVE-FRONT-V2-tool demux <library>");
+		print("TOOL", "       WAIVE-FRONT-V2-tool palette <library>");
+		print("TOOL", "       WAIVE-FRONT-V2-tool parse <library>");
+		print("TOOL", "       WAIVE-FRONT-V2-tool hap <library>");
+	}
+};
+
+int main(int argc, char **argv)
+{
+	av_log_set_level(AV_LOG_QUIET);
+
+	if (argc < 3)
+	{
+		Tool::usage();
+		return 1;
+	}
+
+	std::string command = argv[1];
+	std::string library = argv[2];
+
+	if (command == "palettes")
+	{
+		int every = argc > 3 ? std::atoi(argv[3]) : 15;
+		return Tool::palettes(library, every > 0 ? every : 15);
+	}
+
+	if (command == "proxies")
+	{
+		int maxHeight = argc > 3 ? std::atoi(argv[3]) : 720;
+		return Tool::proxies(library, maxHeight > 0 ? maxHeight : 720);
+	}
+
+	if (command == "demux")
+		return Tool::demux(library);
+
+	if (command == "palette")
+		return Tool::palette(library);
+
+	if (command == "parse")
+		return Tool::parse(library);
+
+	if (command == "hap")
+		return Tool::hap(library);
+
+	Tool::usage();
+	return 1;
+}
@@ -0,0 +1,355 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Hands out opened decoders to all loaders, reusing idle ones and capping how many are open at once
+ *
+ * Opening a decoder allocates its frame pool and starts its threads, which is most of the cost of switching clips.
+ * Released decoders are flushed and kept, and a loader that asks for a decoder with the same codec parameters and
+ * threading gets an idle one back instead of a new one. Once the cap is reached, the least recently used idle
+ * decoder is closed to make room, and if every decoder is in use, none is handed out.
+ */
+class DecoderPool
+{
+public:
+	/**
+	 * @brief Get the pool shared by all loaders
+	 *
+	 * @return DecoderPool& The pool
+	 */
+	static DecoderPool &get()
+	{
+		static DecoderPool pool;
+		return pool;
+	}
+
+	~DecoderPool()
+	{
+		for (Decoder &decoder : decoders)
+		{
+			avcodec_free_context(&decoder.context);
+			avcodec_parameters_free(&decoder.parameters);
+		}
+	}
+
+	/**
+	 * @brief Set the maximum number of open decoders, idle or in use, closing idle decoders that no longer fit
+	 *
+	 * @param maxDecoders Maximum number of decoders
+	 */
+	void setMaxDecoders(int maxDecoders)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->maxDecoders = std::max(1, maxDecoders);
+
+		// Decoders in use are only closed once they are released and the cap is reached again
+		while ((int)decoders.size() > this->maxDecoders && evict())
+			;
+	}
+
+	/**
+	 * @brief Get the maximum number of open decoders
+	 *
+	 * @return int Maximum number of decoders
+	 */
+	int getMaxDecoders()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return maxDecoders;
+	}
+
+	/**
+	 * @brief Check if a decoder can be handed out while leaving room for others
+	 *
+	 * @param headroom Number of decoders that should remain available afterwards
+	 * @return true If there is room
+	 * @return false If too many decoders are in use
+	 */
+	bool hasCapacity(int headroom)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return inUse() + 1 + headroom <= maxDecoders;
+	}
+
+	/**
+	 * @brief Get the number of open decoders
+	 *
+	 * @param used Number of those decoders that are in use
+	 * @return int Number of open decoders
+	 */
+	int getOpenDecoders(int &used)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		used = inUse();
+		return decoders.size();
+	}
+
+	/**
+	 * @brief Get an opened decoder for a stream
+	 *
+	 * The thread count of a decoder is fixed once it is opened, and the share of a layer changes as other layers start
+	 * and stop, so an idle decoder with up to the requested number of threads is reused as well.
+	 *
+	 * @param parameters Codec parameters of the stream
+	 * @param threads Maximum number of decoder threads
+	 * @param threadType Threading type, FF_THREAD_FRAME and/or FF_THREAD_SLICE
+	 * @param lowres Power of two to reduce the resolution by while decoding, for codecs that support it
+	 * @return AVCodecContext* The decoder, to be returned with release, or nullptr if none could be opened
+	 */
+	AVCodecContext *acquire(const AVCodecParameters *parameters, int threads, int threadType, int lowres = 0)
+	{
+		AVCodecParameters *copy = avcodec_parameters_alloc();
+
+		if (copy == nullptr || avcodec_parameters_copy(copy, parameters) < 0)
+		{
+			avcodec_parameters_free(&copy);
+			return nullptr;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			Decoder *best = nullptr;
+
+			for (Decoder &decoder : decoders)
+			{
+				if (!decoder.inUse && decoder.context != nullptr && decoder.threads <= threads && decoder.threadType == threadType && decoder.lowres == lowres && matches(decoder.parameters, parameters))
+				{
+					if (best == nullptr || decoder.threads > best->threads)
+						best = &decoder;
+				}
+			}
+
+			if (best != nullptr)
+			{
+				best->inUse = true;
+				avcodec_parameters_free(&copy);
+
+				return best->context;
+			}
+
+			if ((int)decoders.size() >= maxDecoders && !evict())
+			{
+				avcodec_parameters_free(&copy);
+				return nullptr;
+			}
+
+			// Reserve the slot, so that the decoder can be opened without holding the lock
+			decoders.push_back({nullptr, copy, threads, threadType, lowres, true, 0});
+		}
+
+		AVCodecContext *context = open(copy, threads, threadType, lowres);
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (auto it = decoders.begin(); it != decoders.end(); it++)
+		{
+			if (it->parameters == copy)
+			{
+				if (context != nullptr)
+				{
+					it->context = context;
+				}
+				else
+				{
+					avcodec_parameters_free(&it->parameters);
+					decoders.erase(it);
+				}
+
+				break;
+			}
+		}
+
+		return context;
+	}
+
+	/**
+	 * @brief Return a decoder, which is flushed and kept for reuse
+	 *
+	 * @param context The decoder
+	 */
+	void release(AVCodecContext *context)
+	{
+		if (context == nullptr)
+			return;
+
+		avcodec_flush_buffers(context);
+
+		// The next loader starts at full quality
+		context->skip_loop_filter = AVDISCARD_DEFAULT;
+		context->skip_frame = AVDISCARD_DEFAULT;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (Decoder &decoder : decoders)
+		{
+			if (decoder.context == context)
+			{
+				decoder.inUse = false;
+				decoder.lastUsed = ++clock;
+
+				return;
+			}
+		}
+	}
+
+private:
+	/**
+	 * @brief An opened decoder
+	 *
+	 */
+	struct Decoder
+	{
+		AVCodecContext *context;		/**< The decoder, nullptr while it is being opened */
+		AVCodecParameters *parameters; /**< Codec parameters it was opened with */
+		int threads;					/**< Number of decoder threads */
+		int threadType;					/**< Threading type */
+		int lowres;						/**< Power of two the resolution is reduced by */
+		bool inUse;						/**< Whether a loader is using it */
+		uint64_t lastUsed;				/**< When it was last released */
+	};
+
+	std::mutex mutex;				/**< Guards the decoders */
+	std::vector<Decoder> decoders;	/**< Open decoders, and ones that are being opened */
+	int maxDecoders = 12;			/**< Maximum number of open decoders */
+	uint64_t clock = 0;				/**< Counts releases, to find the least recently used decoder */
+
+	DecoderPool()
+	{
+	}
+
+	/**
+	 * @brief Count the decoders that are in use (mutex must be held)
+	 *
+	 * @return int Number of decoders in use
+	 */
+	int inUse()
+	{
+		return std::count_if(decoders.begin(), decoders.end(), [](const Decoder &decoder)
+							 { return decoder.inUse; });
+	}
+
+	/**
+	 * @brief Close the least recently used idle decoder (mutex must be held)
+	 *
+	 * @return true If a decoder was closed
+	 * @return false If every decoder is in use
+	 */
+	bool evict()
+	{
+		auto oldest = decoders.end();
+
+		for (auto it = decoders.begin(); it != decoders.end(); it++)
+		{
+			if (!it->inUse && (oldest == decoders.end() || it->lastUsed < oldest->lastUsed))
+				oldest = it;
+		}
+
+		if (oldest == decoders.end())
+			return false;
+
+		avcodec_free_context(&oldest->context);
+		avcodec_parameters_free(&oldest->parameters);
+		decoders.erase(oldest);
+
+		return true;
+	}
+
+	/**
+	 * @brief Check if a decoder opened with some codec parameters can decode a stream with other parameters
+	 *
+	 * Decoders only read the extradata when they are opened, so it has to be identical. The color properties and
+	 * aspect ratio are copied into the context as well, and decoders report them for streams that do not signal them
+	 * in the bitstream, so a reused decoder would report those of the previous clip.
+	 *
+	 * @param a Parameters the decoder was opened with
+	 * @param b Parameters of the stream
+	 * @return true If the decoder can be reused
+	 * @return false Otherwise
+	 */
+	static bool matches(const AVCodecParameters *a, const AVCodecParameters *b)
+	{
+		return a->codec_id == b->codec_id &&
+			   a->codec_tag == b->codec_tag &&
+			   a->format == b->format &&
+			   a->width == b->width &&
+			   a->height == b->height &&
+			   a->profile == b->profile &&
+			   a->level == b->level &&
+			   a->color_range == b->color_range &&
+			   a->color_space == b->color_space &&
+			   a->color_primaries == b->color_primaries &&
+			   a->color_trc == b->color_trc &&
+			   a->chroma_location == b->chroma_location &&
+			   av_cmp_q(a->sample_aspect_ratio, b->sample_aspect_ratio) == 0 &&
+			   a->field_order == b->field_order &&
+			   a->extradata_size == b->extradata_size &&
+			   (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+	}
+
+	/**
+	 * @brief Open a new decoder
+	 *
+	 * @param parameters Codec parameters of the stream
+	 * @param threads Number of decoder threads
+	 * @param threadType Threading type
+	 * @param lowres Power of two to reduce the resolution by
+	 * @return AVCodecContext* The decoder, or nullptr on error
+	 */
+	static AVCodecContext *open(const AVCodecParameters *parameters, int threads, int threadType, int lowres)
+	{
+		const AVCodec *codec = avcodec_find_decoder(parameters->codec_id);
+
+		if (codec == nullptr)
+			return nullptr;
+
+		AVCodecContext *context = avcodec_alloc_context3(codec);
+
+		if (context == nullptr || avcodec_parameters_to_context(context, parameters) < 0)
+		{
+			avcodec_free_context(&context);
+			return nullptr;
+		}
+
+		context->thread_count = threads;
+		context->thread_type = threadType;
+		context->lowres = lowres;
+
+		if (avcodec_open2(context, codec, nullptr) < 0)
+		{
+			avcodec_free_context(&context);
+			return nullptr;
+		}
+
+		return context;
+	}
+};
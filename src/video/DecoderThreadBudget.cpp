@@ -0,0 +1,122 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief Shares the machine's cores between the decoders of all layers, so that they do not oversubscribe it
+ *
+ */
+class DecoderThreadBudget
+{
+public:
+	/**
+	 * @brief Get the budget shared by all decoders
+	 *
+	 * @return DecoderThreadBudget& The budget
+	 */
+	static DecoderThreadBudget &get()
+	{
+		static DecoderThreadBudget budget;
+		return budget;
+	}
+
+	/**
+	 * @brief Set the number of decoders expected to run at the same time, which determines the default share
+	 *
+	 * @param consumers Number of decoders, usually the number of enabled layers
+	 */
+	void setConsumers(int consumers)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->consumers = std::max(1, consumers);
+	}
+
+	/**
+	 * @brief Claim threads for a decoder
+	 *
+	 * @param requested Number of threads requested, 0 for a fair share of the budget
+	 * @return int Number of threads granted, at least 1
+	 */
+	int acquire(int requested)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		int wanted = requested > 0 ? requested : std::max(1, total / consumers);
+		int granted = std::max(1, std::min(wanted, total - inUse));
+
+		inUse += granted;
+
+		return granted;
+	}
+
+	/**
+	 * @brief Get the number of threads a decoder would be granted, without claiming them
+	 *
+	 * Used for decoders that are opened ahead of time and sit idle until they are needed.
+	 *
+	 * @param requested Number of threads requested, 0 for a fair share of the budget
+	 * @return int Number of threads, at least 1
+	 */
+	int share(int requested)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		int wanted = requested > 0 ? requested : std::max(1, total / consumers);
+
+		return std::max(1, std::min(wanted, total));
+	}
+
+	/**
+	 * @brief Claim threads that a decoder already uses, even if this exceeds the budget
+	 *
+	 * @param threads Number of threads to claim
+	 */
+	void claim(int threads)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		inUse += threads;
+	}
+
+	/**
+	 * @brief Return threads claimed with acquire
+	 *
+	 * @param granted Number of threads to return
+	 */
+	void release(int granted)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		inUse = std::max(0, inUse - granted);
+	}
+
+private:
+	std::mutex mutex;  /**< Guards the budget */
+	int total;		   /**< Total number of threads available to decoders */
+	int inUse = 0;	   /**< Number of threads currently claimed */
+	int consumers = 1; /**< Number of decoders expected to share the budget */
+
+	DecoderThreadBudget()
+	{
+		// Leave a core for the UI and viewer
+		total = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+	}
+};
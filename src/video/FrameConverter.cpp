@@ -0,0 +1,350 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+#include "libavcodec/avcodec.h"
+#include "libswscale/swscale.h"
+}
+
+#include "VideoFrameDescription.h"
+#include "../util/Logger.cpp"
+using namespace Util::Logger;
+#include <algorithm>
+
+/**
+ * @brief Converts decoded frames for display, keeping the scaling context and output buffers alive between frames
+ *
+ * The scaling context is only rebuilt when the input or output geometry changes. Output frames take their buffer from a
+ * pool, so a frame that has been displayed and released hands its buffer back for the next conversion. Frames are scaled
+ * down to the target size when one is set, so that no more pixels are converted and uploaded than the viewer can show.
+ */
+class FrameConverter
+{
+public:
+	FrameConverter()
+	{
+	}
+
+	~FrameConverter()
+	{
+		reset();
+	}
+
+	/**
+	 * @brief Set the number of slice threads used for conversion, applied when the scaling context is next rebuilt
+	 *
+	 * @param threads Number of threads, 1 to convert on the calling thread only
+	 */
+	void setThreads(int threads)
+	{
+		if (threads != this->threads)
+		{
+			this->threads = threads;
+			freeContext();
+		}
+	}
+
+	/**
+	 * @brief Set the resolution frames are scaled down to, applied from the next conversion
+	 *
+	 * @param width Target width, 0 for the source width
+	 * @param height Target height, 0 for the source height
+	 */
+	void setTargetSize(int width, int height)
+	{
+		targetWidth = width;
+		targetHeight = height;
+	}
+
+	/**
+	 * @brief Set whether YUV 4:2:0 frames are handed on as YUV, for the viewer to convert to RGB on the GPU
+	 *
+	 * @param enabled Whether to keep YUV 4:2:0 frames in YUV
+	 */
+	void setNativeYUV(bool enabled)
+	{
+		nativeYUV = enabled;
+	}
+
+	/**
+	 * @brief Check if a pixel format can be handed to the viewer without conversion
+	 *
+	 * @param format Pixel format to check
+	 * @return true If the viewer can display the format
+	 * @return false If the format has to be converted to RGB
+	 */
+	static bool isNativeFormat(enum AVPixelFormat format)
+	{
+		return format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_YUVJ420P || format == AV_PIX_FMT_NV12;
+	}
+
+	/**
+	 * @brief Describe a converted frame for the viewer
+	 *
+	 * @param frame Converted frame
+	 * @param codedHeight Height of the stream, used to guess the colorspace of untagged frames
+	 * @param vfd Description to fill in
+	 */
+	static void describe(AVFrame *frame, int codedHeight, VideoFrameDescription &vfd)
+	{
+		vfd.width = frame->width;
+		vfd.height = frame->height;
+		vfd.data = frame->data[0];
+		vfd.stride = frame->linesize[0];
+
+		switch (frame->format)
+		{
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+			vfd.format = FrameFormatYUV420P;
+			vfd.chroma[0] = frame->data[1];
+			vfd.chroma[1] = frame->data[2];
+			vfd.chromaStride[0] = frame->linesize[1];
+			vfd.chromaStride[1] = frame->linesize[2];
+			break;
+		case AV_PIX_FMT_NV12:
+			vfd.format = FrameFormatNV12;
+			vfd.chroma[0] = frame->data[1];
+			vfd.chromaStride[0] = frame->linesize[1];
+			break;
+		default:
+			vfd.format = FrameFormatRGB;
+			break;
+		}
+
+		// Untagged streams follow the usual convention of BT.709 for HD and BT.601 for SD
+		vfd.bt709 = frame->colorspace == AVCOL_SPC_BT709 || (frame->colorspace == AVCOL_SPC_UNSPECIFIED && codedHeight >= 720);
+		vfd.fullRange = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+	}
+
+	/**
+	 * @brief Convert a frame to a format the viewer can display
+	 *
+	 * YUV 4:2:0 frames that need no scaling are passed on as a new reference to the decoder's own buffer. Other YUV
+	 * 4:2:0 frames are scaled to planar YUV 4:2:0, and everything else is converted to RGB.
+	 *
+	 * @param frame Frame to convert
+	 * @param out_frame Converted frame, owned by the caller
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	int convert(AVFrame *frame, AVFrame **out_frame)
+	{
+		enum AVPixelFormat srcFormat = (enum AVPixelFormat)frame->format;
+		int dstWidth = targetWidth > 0 ? std::min(frame->width, targetWidth) : frame->width;
+		int dstHeight = targetHeight > 0 ? std::min(frame->height, targetHeight) : frame->height;
+		bool yuv = nativeYUV && isNativeFormat(srcFormat);
+
+		if (yuv && dstWidth == frame->width && dstHeight == frame->height)
+		{
+			*out_frame = av_frame_clone(frame);
+			if (*out_frame == NULL)
+			{
+				error("VIDEO", "Could not reference YUV frame");
+				return -1;
+			}
+
+			return 0;
+		}
+
+		enum AVPixelFormat dstFormat = AV_PIX_FMT_RGB24;
+		if (yuv)
+			dstFormat = srcFormat == AV_PIX_FMT_YUVJ420P ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+
+		if (configure(frame->width, frame->height, srcFormat, dstWidth, dstHeight, dstFormat) < 0)
+			return -1;
+
+		*out_frame = av_frame_alloc();
+		if (*out_frame == NULL)
+		{
+			error("VIDEO", "Could not allocate converted frame");
+			return -1;
+		}
+
+		(*out_frame)->format = format;
+		(*out_frame)->width = width;
+		(*out_frame)->height = height;
+		(*out_frame)->buf[0] = av_buffer_pool_get(pool);
+
+		if ((*out_frame)->buf[0] == NULL)
+		{
+			error("VIDEO", "Could not get buffer for converted frame");
+			av_frame_free(out_frame);
+			return -1;
+		}
+
+		uint8_t *plane = (*out_frame)->buf[0]->data;
+
+		for (int i = 0; i < 3 && linesizes[i] > 0; i++)
+		{
+			(*out_frame)->data[i] = plane;
+			(*out_frame)->linesize[i] = linesizes[i];
+			plane += linesizes[i] * (i == 0 ? height : (height + 1) / 2);
+		}
+
+		// Unlike sws_scale, this spreads the frame over the slice threads of the context
+		int ret = sws_scale_frame(sws_ctx, *out_frame, frame);
+
+		if (ret < 0)
+		{
+			error("VIDEO", "Error while converting frame");
+			av_frame_free(out_frame);
+			return -1;
+		}
+
+		(*out_frame)->pts = frame->pts;
+		(*out_frame)->colorspace = frame->colorspace;
+		(*out_frame)->color_range = frame->color_range;
+
+		return 0;
+	}
+
+	/**
+	 * @brief Free the scaling context and the buffer pool
+	 *
+	 */
+	void reset()
+	{
+		freeContext();
+
+		// Buffers still held by frames in flight keep the pool alive until they are released
+		av_buffer_pool_uninit(&pool);
+
+		sourceWidth = 0;
+		sourceHeight = 0;
+		sourceFormat = AV_PIX_FMT_NONE;
+		width = 0;
+		height = 0;
+		format = AV_PIX_FMT_NONE;
+	}
+
+private:
+	struct SwsContext *sws_ctx = nullptr;			 /**< Scaling context */
+	AVBufferPool *pool = nullptr;					 /**< Pool of output buffers */
+	int threads = 1;								 /**< Number of slice threads */
+	int sourceWidth = 0;							 /**< Width of the input frames */
+	int sourceHeight = 0;							 /**< Height of the input frames */
+	enum AVPixelFormat sourceFormat = AV_PIX_FMT_NONE; /**< Pixel format of the input frames */
+	int width = 0;									 /**< Width of the output frames */
+	int height = 0;									 /**< Height of the output frames */
+	enum AVPixelFormat format = AV_PIX_FMT_NONE;	 /**< Pixel format of the output frames */
+	int linesizes[3] = {0};							 /**< Bytes per output row of each plane */
+	bool nativeYUV = false;							 /**< Whether YUV 4:2:0 frames are kept in YUV */
+	int targetWidth = 0;							 /**< Width to scale down to, 0 for the source width */
+	int targetHeight = 0;							 /**< Height to scale down to, 0 for the source height */
+
+	/**
+	 * @brief Make sure the scaling context and buffer pool match the input and output geometry
+	 *
+	 * @param srcWidth Width of the input frame
+	 * @param srcHeight Height of the input frame
+	 * @param srcFormat Pixel format of the input frame
+	 * @param dstWidth Width of the output frame
+	 * @param dstHeight Height of the output frame
+	 * @param dstFormat Pixel format of the output frame, RGB24 or planar YUV 4:2:0
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	int configure(int srcWidth, int srcHeight, enum AVPixelFormat srcFormat, int dstWidth, int dstHeight, enum AVPixelFormat dstFormat)
+	{
+		if (srcWidth != sourceWidth || srcHeight != sourceHeight || srcFormat != sourceFormat)
+		{
+			freeContext();
+
+			sourceWidth = srcWidth;
+			sourceHeight = srcHeight;
+			sourceFormat = srcFormat;
+		}
+
+		if (dstWidth != width || dstHeight != height || dstFormat != format)
+		{
+			freeContext();
+			av_buffer_pool_uninit(&pool);
+
+			width = dstWidth;
+			height = dstHeight;
+			format = dstFormat;
+
+			// Rows are padded to a whole number of 32-pixel blocks, which keeps them 32-byte aligned for swscale and
+			// still a whole number of pixels for the texture upload
+			if (format == AV_PIX_FMT_RGB24)
+			{
+				linesizes[0] = FFALIGN(width, 32) * 3;
+				linesizes[1] = 0;
+				linesizes[2] = 0;
+			}
+			else
+			{
+				linesizes[0] = FFALIGN(width, 32);
+				linesizes[1] = FFALIGN((width + 1) / 2, 32);
+				linesizes[2] = linesizes[1];
+			}
+
+			pool = av_buffer_pool_init(linesizes[0] * height + (linesizes[1] + linesizes[2]) * ((height + 1) / 2), nullptr);
+
+			if (pool == nullptr)
+			{
+				error("VIDEO", "Could not allocate frame pool");
+				width = 0;
+				height = 0;
+				return -1;
+			}
+		}
+
+		if (sws_ctx != nullptr)
+			return 0;
+
+		sws_ctx = sws_alloc_context();
+		if (sws_ctx == nullptr)
+		{
+			error("VIDEO", "Could not allocate sws context");
+			return -1;
+		}
+
+		av_opt_set_int(sws_ctx, "srcw", sourceWidth, 0);
+		av_opt_set_int(sws_ctx, "srch", sourceHeight, 0);
+		av_opt_set_int(sws_ctx, "src_format", sourceFormat, 0);
+		av_opt_set_int(sws_ctx, "dstw", width, 0);
+		av_opt_set_int(sws_ctx, "dsth", height, 0);
+		av_opt_set_int(sws_ctx, "dst_format", format, 0);
+		av_opt_set_int(sws_ctx, "sws_flags", SWS_BILINEAR, 0);
+		av_opt_set_int(sws_ctx, "threads", threads, 0);
+
+		if (sws_init_context(sws_ctx, nullptr, nullptr) < 0)
+		{
+			error("VIDEO", "Could not initialize sws context");
+			freeContext();
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * @brief Free the scaling context
+	 *
+	 */
+	void freeContext()
+	{
+		sws_freeContext(sws_ctx);
+		sws_ctx = nullptr;
+	}
+};
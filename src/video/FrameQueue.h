@@ -0,0 +1,136 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+/**
+ * @brief Bounded lock-free single-producer/single-consumer ring buffer, used to hand decoded frames from a decode thread to the UI thread
+ *
+ * @tparam T The type of the items in the queue
+ */
+template <typename T>
+class FrameQueue
+{
+public:
+	/**
+	 * @brief Construct a new FrameQueue object
+	 *
+	 * @param capacity The maximum number of items the queue can hold
+	 */
+	FrameQueue(size_t capacity)
+		: slots(capacity + 1)
+	{
+	}
+
+	/**
+	 * @brief Push an item onto the queue (producer only)
+	 *
+	 * @param item The item to push
+	 * @return true If the item was pushed
+	 * @return false If the queue is full
+	 */
+	bool push(const T &item)
+	{
+		size_t write = writeIndex.load(std::memory_order_relaxed);
+		size_t next = increment(write);
+
+		if (next == readIndex.load(std::memory_order_acquire))
+			return false;
+
+		slots[write] = item;
+		writeIndex.store(next, std::memory_order_release);
+
+		return true;
+	}
+
+	/**
+	 * @brief Pop an item from the queue (consumer only)
+	 *
+	 * @param item The popped item
+	 * @return true If an item was popped
+	 * @return false If the queue is empty
+	 */
+	bool pop(T &item)
+	{
+		size_t read = readIndex.load(std::memory_order_relaxed);
+
+		if (read == writeIndex.load(std::memory_order_acquire))
+			return false;
+
+		item = slots[read];
+		readIndex.store(increment(read), std::memory_order_release);
+
+		return true;
+	}
+
+	/**
+	 * @brief Get the item at the front of the queue without popping it (consumer only)
+	 *
+	 * @return T* The item at the front of the queue, or nullptr if the queue is empty
+	 */
+	T *front()
+	{
+		size_t read = readIndex.load(std::memory_order_relaxed);
+
+		if (read == writeIndex.load(std::memory_order_acquire))
+			return nullptr;
+
+		return &slots[read];
+	}
+
+	/**
+	 * @brief Check if the queue is full
+	 *
+	 * @return true If the queue is full
+	 * @return false If the queue is not full
+	 */
+	bool full()
+	{
+		return increment(writeIndex.load(std::memory_order_acquire)) == readIndex.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * @brief Check if the queue is empty
+	 *
+	 * @return true If the queue is empty
+	 * @return false If the queue is not empty
+	 */
+	bool empty()
+	{
+		return readIndex.load(std::memory_order_acquire) == writeIndex.load(std::memory_order_acquire);
+	}
+
+private:
+	std::vector<T> slots;					/**< The slots of the ring buffer, one more than the capacity */
+	std::atomic<size_t> readIndex{0};		/**< The index of the next item to pop */
+	std::atomic<size_t> writeIndex{0};		/**< The index of the next slot to push to */
+
+	/**
+	 * @brief Advance an index by one slot, wrapping around
+	 *
+	 * @param index The index to advance
+	 * @return size_t The advanced index
+	 */
+	size_t increment(size_t index)
+	{
+		return (index + 1) % slots.size();
+	}
+};
@@ -0,0 +1,472 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "VideoFrameDescription.h"
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Unpacks HAP frames into the BC1 or BC3 blocks they store, so that they can be uploaded to the GPU as they are
+ *
+ * A HAP frame is a section with a 4 or 8 byte header that gives its size, its texture format and how the blocks were
+ * compressed: not at all, with Snappy, or in chunks that are each stored or Snappy compressed. Only the BC1 (HAP) and
+ * BC3 (HAP Alpha) formats are unpacked; HAP Q stores YCoCg colors and is left to FFmpeg's decoder.
+ */
+class HapUnpacker
+{
+public:
+	/**
+	 * @brief Get the texture format of a HAP frame
+	 *
+	 * @param data Frame data
+	 * @param size Size of the frame data in bytes
+	 * @return int FrameFormatBC1 or FrameFormatBC3, or -1 if the frame is not in a format that can be unpacked
+	 */
+	static int probe(const uint8_t *data, int size)
+	{
+		Section section;
+
+		if (!readSection(data, size, section))
+			return -1;
+
+		switch (section.type & 0x0F)
+		{
+		case 0x0B:
+			return FrameFormatBC1;
+		case 0x0E:
+			return FrameFormatBC3;
+		default:
+			return -1;
+		}
+	}
+
+	/**
+	 * @brief Get the number of bytes per row of blocks
+	 *
+	 * @param format FrameFormatBC1 or FrameFormatBC3
+	 * @param width Width of the frame in pixels
+	 * @return int Bytes per row of 4x4 blocks
+	 */
+	static int getStride(int format, int width)
+	{
+		return (width + 3) / 4 * (format == FrameFormatBC1 ? 8 : 16);
+	}
+
+	/**
+	 * @brief Get the size of the blocks of a whole frame
+	 *
+	 * @param format FrameFormatBC1 or FrameFormatBC3
+	 * @param width Width of the frame in pixels
+	 * @param height Height of the frame in pixels
+	 * @return int Size in bytes
+	 */
+	static int getSize(int format, int width, int height)
+	{
+		return getStride(format, width) * ((height + 3) / 4);
+	}
+
+	/**
+	 * @brief Unpack the blocks of a HAP frame
+	 *
+	 * @param data Frame data
+	 * @param size Size of the frame data in bytes
+	 * @param out Buffer for the blocks
+	 * @param outSize Size of the buffer, which must be exactly the size of the blocks
+	 * @return int 0 if successful, -1 if the frame is invalid
+	 */
+	static int unpack(const uint8_t *data, int size, uint8_t *out, int outSize)
+	{
+		Section section;
+
+		if (!readSection(data, size, section))
+			return -1;
+
+		switch (section.type & 0xF0)
+		{
+		case 0xA0:
+			if (section.size != (size_t)outSize)
+				return -1;
+
+			memcpy(out, section.data, outSize);
+			return 0;
+		case 0xB0:
+			return decompressSnappy(section.data, section.size, out, outSize) ? 0 : -1;
+		case 0xC0:
+			return unpackChunks(section.data, section.size, out, outSize) ? 0 : -1;
+		default:
+			return -1;
+		}
+	}
+
+	/**
+	 * @brief Decode a single pixel from BC1 or BC3 blocks
+	 *
+	 * @param blocks The blocks
+	 * @param stride Bytes per row of blocks
+	 * @param format FrameFormatBC1 or FrameFormatBC3
+	 * @param x Horizontal position of the pixel
+	 * @param y Vertical position of the pixel
+	 * @return uint32_t The pixel packed as 0x00BBGGRR
+	 */
+	static uint32_t decodePixel(const uint8_t *blocks, int stride, int format, int x, int y)
+	{
+		// BC3 blocks start with 8 bytes of alpha, followed by a BC1 color block
+		const uint8_t *block = blocks + (size_t)(y / 4) * stride + (x / 4) * (format == FrameFormatBC1 ? 8 : 16);
+
+		if (format == FrameFormatBC3)
+			block += 8;
+
+		int c0 = block[0] | (block[1] << 8);
+		int c1 = block[2] | (block[3] << 8);
+		int index = (block[4 + y % 4] >> ((x % 4) * 2)) & 3;
+
+		int rgb0[3] = {(c0 >> 11) * 255 / 31, ((c0 >> 5) & 63) * 255 / 63, (c0 & 31) * 255 / 31};
+		int rgb1[3] = {(c1 >> 11) * 255 / 31, ((c1 >> 5) & 63) * 255 / 63, (c1 & 31) * 255 / 31};
+		int rgb[3];
+
+		// BC1 blocks with c0 <= c1 have a single interpolated color, and black (or transparent) as the fourth
+		bool fourColors = format == FrameFormatBC3 || c0 > c1;
+
+		for (int c = 0; c < 3; c++)
+		{
+			if (index == 0)
+				rgb[c] = rgb0[c];
+			else if (index == 1)
+				rgb[c] = rgb1[c];
+			else if (fourColors)
+				rgb[c] = index == 2 ? (2 * rgb0[c] + rgb1[c]) / 3 : (rgb0[c] + 2 * rgb1[c]) / 3;
+			else
+				rgb[c] = index == 2 ? (rgb0[c] + rgb1[c]) / 2 : 0;
+		}
+
+		return rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
+	}
+
+private:
+	/**
+	 * @brief A section of a HAP frame
+	 *
+	 */
+	struct Section
+	{
+		int type;			 /**< Type of the section */
+		const uint8_t *data; /**< Contents of the section */
+		size_t size;		 /**< Size of the contents in bytes */
+		size_t headerSize;	 /**< Size of the header in bytes */
+	};
+
+	/**
+	 * @brief Read a little-endian integer
+	 *
+	 * @param data Data to read from
+	 * @param bytes Number of bytes
+	 * @return uint32_t The integer
+	 */
+	static uint32_t readLE(const uint8_t *data, int bytes)
+	{
+		uint32_t value = 0;
+
+		for (int i = 0; i < bytes; i++)
+			value |= uint32_t(data[i]) << (8 * i);
+
+		return value;
+	}
+
+	/**
+	 * @brief Read the header of a section
+	 *
+	 * @param data Data starting at the section
+	 * @param size Size of the data in bytes
+	 * @param section The section
+	 * @return true If the section fits in the data
+	 * @return false Otherwise
+	 */
+	static bool readSection(const uint8_t *data, size_t size, Section &section)
+	{
+		if (size < 4)
+			return false;
+
+		section.size = readLE(data, 3);
+		section.type = data[3];
+		section.headerSize = 4;
+
+		// Sections of 16 MiB or more store their size in the four bytes after the type
+		if (section.size == 0)
+		{
+			if (size < 8)
+				return false;
+
+			section.size = readLE(data + 4, 4);
+			section.headerSize = 8;
+		}
+
+		if (section.size > size - section.headerSize)
+			return false;
+
+		section.data = data + section.headerSize;
+
+		return true;
+	}
+
+	/**
+	 * @brief Unpack the contents of a chunked section
+	 *
+	 * The section starts with a decode instructions container, which holds the compressor and size of every chunk and
+	 * optionally their offsets. The chunks follow the container, and together make up the blocks.
+	 *
+	 * @param data Contents of the section
+	 * @param size Size of the contents in bytes
+	 * @param out Buffer for the blocks
+	 * @param outSize Size of the buffer
+	 * @return true If all chunks were unpacked and exactly filled the buffer
+	 * @return false Otherwise
+	 */
+	static bool unpackChunks(const uint8_t *data, size_t size, uint8_t *out, size_t outSize)
+	{
+		Section container;
+
+		if (!readSection(data, size, container) || container.type != 0x01)
+			return false;
+
+		const uint8_t *compressors = nullptr;
+		const uint8_t *sizes = nullptr;
+		const uint8_t *offsets = nullptr;
+		size_t chunks = 0;
+		size_t sizesSize = 0;
+		size_t offsetsSize = 0;
+		size_t position = 0;
+
+		while (position < container.size)
+		{
+			Section table;
+
+			if (!readSection(container.data + position, container.size - position, table))
+				return false;
+
+			if (table.type == 0x02)
+			{
+				compressors = table.data;
+				chunks = table.size;
+			}
+			else if (table.type == 0x03)
+			{
+				sizes = table.data;
+				sizesSize = table.size;
+			}
+			else if (table.type == 0x04)
+			{
+				offsets = table.data;
+				offsetsSize = table.size;
+			}
+
+			position += table.headerSize + table.size;
+		}
+
+		if (compressors == nullptr || sizes == nullptr || sizesSize < chunks * 4 || (offsets != nullptr && offsetsSize < chunks * 4))
+			return false;
+
+		const uint8_t *chunkData = container.data + container.size;
+		size_t chunkDataSize = size - container.headerSize - container.size;
+		size_t chunkOffset = 0;
+		size_t written = 0;
+
+		for (size_t i = 0; i < chunks; i++)
+		{
+			size_t chunkSize = readLE(sizes + i * 4, 4);
+
+			if (offsets != nullptr)
+				chunkOffset = readLE(offsets + i * 4, 4);
+
+			if (chunkOffset > chunkDataSize || chunkSize > chunkDataSize - chunkOffset)
+				return false;
+
+			const uint8_t *chunk = chunkData + chunkOffset;
+
+			if (compressors[i] == 0x0A)
+			{
+				if (chunkSize > outSize - written)
+					return false;
+
+				memcpy(out + written, chunk, chunkSize);
+				written += chunkSize;
+			}
+			else if (compressors[i] == 0x0B)
+			{
+				size_t length;
+
+				if (!readSnappyLength(chunk, chunkSize, length) || length > outSize - written)
+					return false;
+
+				if (!decompressSnappy(chunk, chunkSize, out + written, length))
+					return false;
+
+				written += length;
+			}
+			else
+			{
+				return false;
+			}
+
+			chunkOffset += chunkSize;
+		}
+
+		return written == outSize;
+	}
+
+	/**
+	 * @brief Read the uncompressed length at the start of Snappy data
+	 *
+	 * @param data Compressed data
+	 * @param size Size of the compressed data in bytes
+	 * @param length Uncompressed length
+	 * @return true If the length could be read
+	 * @return false Otherwise
+	 */
+	static bool readSnappyLength(const uint8_t *data, size_t size, size_t &length)
+	{
+		size_t position = 0;
+		return readVarint(data, size, position, length);
+	}
+
+	/**
+	 * @brief Read a little-endian base 128 varint
+	 *
+	 * @param data Data to read from
+	 * @param size Size of the data in bytes
+	 * @param position Position to read at, moved past the varint
+	 * @param value The value
+	 * @return true If the varint could be read
+	 * @return false Otherwise
+	 */
+	static bool readVarint(const uint8_t *data, size_t size, size_t &position, size_t &value)
+	{
+		value = 0;
+
+		for (int shift = 0; shift < 35; shift += 7)
+		{
+			if (position >= size)
+				return false;
+
+			uint8_t byte = data[position++];
+			value |= size_t(byte & 0x7F) << shift;
+
+			if ((byte & 0x80) == 0)
+				return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * @brief Decompress Snappy data
+	 *
+	 * @param data Compressed data
+	 * @param size Size of the compressed data in bytes
+	 * @param out Buffer for the uncompressed data
+	 * @param outSize Size of the buffer, which must be exactly the uncompressed length
+	 * @return true If the data was decompressed
+	 * @return false If the data is invalid or does not match the buffer size
+	 */
+	static bool decompressSnappy(const uint8_t *data, size_t size, uint8_t *out, size_t outSize)
+	{
+		size_t position = 0;
+		size_t length;
+
+		if (!readVarint(data, size, position, length) || length != outSize)
+			return false;
+
+		size_t written = 0;
+
+		while (position < size)
+		{
+			uint8_t tag = data[position++];
+			size_t count, offset;
+
+			if ((tag & 3) == 0)
+			{
+				// Literal, with lengths over 60 bytes stored in the 1 to 4 bytes after the tag
+				count = tag >> 2;
+
+				if (count >= 60)
+				{
+					int bytes = int(count) - 59;
+
+					if (position + bytes > size)
+						return false;
+
+					count = readLE(data + position, bytes);
+					position += bytes;
+				}
+
+				count++;
+
+				if (count > size - position || count > outSize - written)
+					return false;
+
+				memcpy(out + written, data + position, count);
+				position += count;
+				written += count;
+				continue;
+			}
+
+			if ((tag & 3) == 1)
+			{
+				if (position + 1 > size)
+					return false;
+
+				count = ((tag >> 2) & 7) + 4;
+				offset = ((tag >> 5) << 8) | data[position];
+				position += 1;
+			}
+			else
+			{
+				int bytes = (tag & 3) == 2 ? 2 : 4;
+
+				if (position + bytes > size)
+					return false;
+
+				count = (tag >> 2) + 1;
+				offset = readLE(data + position, bytes);
+				position += bytes;
+			}
+
+			if (offset == 0 || offset > written || count > outSize - written)
+				return false;
+
+			// Copies may overlap the bytes they produce, which repeats a pattern
+			uint8_t *destination = out + written;
+			const uint8_t *source = destination - offset;
+
+			if (offset >= count)
+			{
+				memcpy(destination, source, count);
+			}
+			else
+			{
+				for (size_t i = 0; i < count; i++)
+					destination[i] = source[i];
+			}
+
+			written += count;
+		}
+
+		return written == outSize;
+	}
+};
@@ -0,0 +1,438 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+}
+
+#include <nlohmann/json.hpp>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../util/Logger.cpp"
+using namespace Util::Logger;
+
+/**
+ * @brief The keyframes of a video stream, so that a seek lands exactly on the keyframe before the target
+ *
+ * MP4 and MOV files carry their keyframes in the container, which the demuxer already read when the file was opened.
+ * For other containers the packets are scanned once in the background by KeyframeScanner, and the result is stored in a
+ * sidecar file next to the video, stamped with its size and modification time like the palette cache.
+ */
+class KeyframeIndex
+{
+public:
+	/**
+	 * @brief Fill the index from the demuxer's own index or from the sidecar, which costs no reading of the video
+	 *
+	 * @param videoPath Path to the video
+	 * @param stream The video stream
+	 * @return true If the index was filled
+	 * @return false If the stream has to be scanned
+	 */
+	bool load(const std::string &videoPath, AVStream *stream)
+	{
+		clear();
+
+		int entries = avformat_index_get_entries_count(stream);
+
+		for (int i = 0; i < entries; i++)
+		{
+			const AVIndexEntry *entry = avformat_index_get_entry(stream, i);
+
+			if (entry != nullptr && (entry->flags & AVINDEX_KEYFRAME))
+				timestamps.push_back(entry->timestamp);
+		}
+
+		if (timestamps.size() > 0)
+		{
+			fromDemuxer = true;
+			return true;
+		}
+
+		return read(videoPath);
+	}
+
+	/**
+	 * @brief Fill the index by reading every packet of the video's first video stream, through a demuxer of its own
+	 *
+	 * @param videoPath Path to the video, to store the index next to
+	 * @param cancelled Flag that aborts the scan while it is set, or nullptr for none
+	 * @return true If any keyframes were found
+	 * @return false Otherwise
+	 */
+	bool scan(const std::string &videoPath, const std::atomic<bool> *cancelled)
+	{
+		clear();
+
+		AVFormatContext *format = avformat_alloc_context();
+
+		if (format == nullptr)
+			return false;
+
+		format->interrupt_callback.callback = interrupt;
+		format->interrupt_callback.opaque = (void *)cancelled;
+
+		if (avformat_open_input(&format, videoPath.c_str(), nullptr, nullptr) < 0)
+			return false;
+
+		int streamIndex = -1;
+
+		if (avformat_find_stream_info(format, nullptr) >= 0)
+		{
+			for (unsigned int i = 0; i < format->nb_streams; i++)
+			{
+				if (streamIndex < 0 && format->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+					streamIndex = i;
+				else
+					format->streams[i]->discard = AVDISCARD_ALL;
+			}
+		}
+
+		AVPacket *packet = streamIndex >= 0 ? av_packet_alloc() : nullptr;
+
+		while (packet != nullptr && av_read_frame(format, packet) >= 0)
+		{
+			if (packet->stream_index == streamIndex && (packet->flags & AV_PKT_FLAG_KEY))
+			{
+				timestamps.push_back(packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts);
+				positions.push_back(packet->pos);
+			}
+
+			av_packet_unref(packet);
+		}
+
+		av_packet_free(&packet);
+		avformat_close_input(&format);
+
+		// A cancelled scan is incomplete, and is neither stored nor used
+		if (cancelled != nullptr && *cancelled)
+			clear();
+
+		if (timestamps.size() == 0)
+			return false;
+
+		write(videoPath);
+		return true;
+	}
+
+	/**
+	 * @brief Check if the index holds any keyframes
+	 *
+	 * @return true If it does
+	 * @return false If it is empty
+	 */
+	bool isLoaded()
+	{
+		return timestamps.size() > 0;
+	}
+
+	/**
+	 * @brief Seek the demuxer to the last keyframe at or before a timestamp
+	 *
+	 * Keyframes found by scanning are sought by their byte position, since a demuxer without an index of its own
+	 * can only guess where a timestamp is.
+	 *
+	 * @param format The demuxer
+	 * @param streamIndex Index of the video stream
+	 * @param timestamp Target timestamp in the stream's time base
+	 * @return int 0 if successful, a negative value otherwise
+	 */
+	int seek(AVFormatContext *format, int streamIndex, int64_t timestamp)
+	{
+		auto next = std::upper_bound(timestamps.begin(), timestamps.end(), timestamp);
+		size_t keyframe = next == timestamps.begin() ? 0 : next - timestamps.begin() - 1;
+
+		if (!fromDemuxer && keyframe < positions.size() && positions[keyframe] >= 0 && !(format->iformat->flags & AVFMT_NO_BYTE_SEEK))
+			return av_seek_frame(format, streamIndex, positions[keyframe], AVSEEK_FLAG_BYTE);
+
+		return av_seek_frame(format, streamIndex, timestamps[keyframe], AVSEEK_FLAG_BACKWARD);
+	}
+
+	/**
+	 * @brief Empty the index
+	 *
+	 */
+	void clear()
+	{
+		timestamps.clear();
+		positions.clear();
+		fromDemuxer = false;
+	}
+
+private:
+	std::vector<int64_t> timestamps; /**< Timestamps of the keyframes in the stream's time base, in order */
+	std::vector<int64_t> positions;	 /**< Byte positions of the keyframes, only known for scanned indices */
+	bool fromDemuxer = false;		 /**< Whether the keyframes come from the demuxer's own index */
+
+	/**
+	 * @brief Abort a scan when its flag is set (called by FFmpeg)
+	 *
+	 * @param opaque The flag, or nullptr
+	 * @return int 1 to abort, 0 to continue
+	 */
+	static int interrupt(void *opaque)
+	{
+		const std::atomic<bool> *cancelled = (const std::atomic<bool> *)opaque;
+		return cancelled != nullptr && *cancelled ? 1 : 0;
+	}
+
+	/**
+	 * @brief Get the path of the sidecar file of a video
+	 *
+	 * @param videoPath Path to the video
+	 * @return std::string Path to the sidecar file
+	 */
+	static std::string getSidecarPath(const std::string &videoPath)
+	{
+		return videoPath + ".keyframes.json";
+	}
+
+	/**
+	 * @brief Get the identity of a file
+	 *
+	 * @param path Path to the file
+	 * @param size Size of the file in bytes
+	 * @param mtime Modification time of the file in seconds
+	 * @return true If the file exists
+	 * @return false If the file could not be found
+	 */
+	static bool identify(const std::string &path, long long &size, long long &mtime)
+	{
+		struct stat info;
+
+		if (stat(path.c_str(), &info) != 0)
+			return false;
+
+		size = info.st_size;
+		mtime = info.st_mtime;
+
+		return true;
+	}
+
+	/**
+	 * @brief Read the index from the sidecar, if it is still valid
+	 *
+	 * @param videoPath Path to the video
+	 * @return true If the index was read
+	 * @return false If the sidecar is missing, invalid or out of date
+	 */
+	bool read(const std::string &videoPath)
+	{
+		long long size, mtime;
+
+		if (!identify(videoPath, size, mtime))
+			return false;
+
+		std::ifstream file(getSidecarPath(videoPath));
+
+		if (!file.is_open())
+			return false;
+
+		try
+		{
+			nlohmann::json data;
+			file >> data;
+
+			if (data.at("size").get<long long>() != size || data.at("mtime").get<long long>() != mtime)
+				return false;
+
+			std::vector<int64_t> cachedTimestamps = data.at("timestamps").get<std::vector<int64_t>>();
+			std::vector<int64_t> cachedPositions = data.at("positions").get<std::vector<int64_t>>();
+
+			if (cachedTimestamps.size() == 0 || cachedPositions.size() != cachedTimestamps.size())
+				return false;
+
+			timestamps = cachedTimestamps;
+			positions = cachedPositions;
+
+			return true;
+		}
+		catch (const std::exception &e)
+		{
+			warn("VIDEO", "Ignoring invalid keyframe index for " + videoPath);
+			return false;
+		}
+	}
+
+	/**
+	 * @brief Write the index to the sidecar, stamped with the video's current identity
+	 *
+	 * @param videoPath Path to the video
+	 */
+	void write(const std::string &videoPath)
+	{
+		long long size, mtime;
+
+		if (!identify(videoPath, size, mtime))
+			return;
+
+		std::ofstream file(getSidecarPath(videoPath));
+
+		// Like the palette cache, a read-only library only means the video is scanned every time
+		if (!file.is_open())
+			return;
+
+		nlohmann::json data = {{"size", size}, {"mtime", mtime}, {"timestamps", timestamps}, {"positions", positions}};
+		file << data.dump();
+	}
+};
+
+/**
+ * @brief Scans the videos whose containers have no index of their own, away from the threads that play them
+ *
+ * A loader requests a scan when it loads such a video, and seeks by the demuxer's estimate until it finds the result
+ * here. The scans are run by the prefetch thread. Results are kept in memory as well as in the sidecar, so that a
+ * read-only library is not scanned again for every load.
+ */
+class KeyframeScanner
+{
+public:
+	/**
+	 * @brief Get the scanner shared by all loaders
+	 *
+	 * @return KeyframeScanner& The scanner
+	 */
+	static KeyframeScanner &get()
+	{
+		static KeyframeScanner scanner;
+		return scanner;
+	}
+
+	/**
+	 * @brief Queue a video for scanning, unless it is queued or scanned already
+	 *
+	 * @param videoPath Path to the video
+	 */
+	void request(const std::string &videoPath)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (std::find(pending.begin(), pending.end(), videoPath) != pending.end())
+			return;
+
+		for (const Result &result : results)
+		{
+			if (result.path == videoPath)
+				return;
+		}
+
+		pending.push_back(videoPath);
+	}
+
+	/**
+	 * @brief Get the index of a scanned video
+	 *
+	 * @param videoPath Path to the video
+	 * @param index Set to the index if the scan found any keyframes
+	 * @return true If the index was set
+	 * @return false If the video has not been scanned yet, or has no keyframes
+	 */
+	bool find(const std::string &videoPath, KeyframeIndex &index)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (auto it = results.begin(); it != results.end(); it++)
+		{
+			if (it->path == videoPath)
+			{
+				results.splice(results.begin(), results, it);
+
+				if (!results.front().index.isLoaded())
+					return false;
+
+				index = results.front().index;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * @brief Scan the next queued video
+	 *
+	 * @param cancelled Flag that aborts the scan while it is set
+	 * @return true If a video was scanned
+	 * @return false If none are queued
+	 */
+	bool scanNext(const std::atomic<bool> *cancelled)
+	{
+		std::string videoPath;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (pending.empty())
+				return false;
+
+			videoPath = pending.front();
+		}
+
+		Result result;
+		result.path = videoPath;
+		result.index.scan(videoPath, cancelled);
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		pending.pop_front();
+
+		if (*cancelled)
+			return true;
+
+		// Videos without keyframes are remembered as well, so they are not scanned again
+		results.push_front(result);
+
+		if (results.size() > maxResults)
+			results.pop_back();
+
+		return true;
+	}
+
+private:
+	/**
+	 * @brief A scanned video
+	 *
+	 */
+	struct Result
+	{
+		std::string path;	/**< Path to the video */
+		KeyframeIndex index; /**< Its keyframes, empty if none were found */
+	};
+
+	static const size_t maxResults = 32; /**< Maximum number of scanned videos kept in memory */
+
+	std::mutex mutex;				  /**< Guards the queue and results */
+	std::deque<std::string> pending;  /**< Videos waiting to be scanned, in order of request */
+	std::list<Result> results;		  /**< Scanned videos, most recently used first */
+
+	KeyframeScanner()
+	{
+	}
+};
@@ -0,0 +1,276 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+#include "libavformat/avio.h"
+#include "libavutil/mem.h"
+}
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "../util/Logger.cpp"
+using namespace Util::Logger;
+
+/**
+ * @brief Maps a video file into memory and exposes it to FFmpeg as an AVIOContext
+ *
+ * Reads are served by copying from the mapping, so once a clip is in the page cache, looping it no longer costs a
+ * system call per packet. The whole file is hinted for readahead when it is mapped.
+ */
+class MappedFile
+{
+public:
+	~MappedFile()
+	{
+		close();
+	}
+
+	/**
+	 * @brief Map a file into memory
+	 *
+	 * @param path Path to the file
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	int open(const std::string &path)
+	{
+		close();
+
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+		if (file == INVALID_HANDLE_VALUE)
+			return -1;
+
+		LARGE_INTEGER fileSize;
+
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+		{
+			close();
+			return -1;
+		}
+
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (mapping == NULL)
+		{
+			close();
+			return -1;
+		}
+
+		data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+		if (data == nullptr)
+		{
+			close();
+			return -1;
+		}
+
+		size = fileSize.QuadPart;
+#else
+		int descriptor = ::open(path.c_str(), O_RDONLY);
+
+		if (descriptor < 0)
+			return -1;
+
+		struct stat info;
+
+		if (fstat(descriptor, &info) != 0 || info.st_size == 0)
+		{
+			::close(descriptor);
+			return -1;
+		}
+
+		void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+		// The mapping keeps the file alive on its own
+		::close(descriptor);
+
+		if (mapped == MAP_FAILED)
+			return -1;
+
+		// Clips are small and read front to back, over and over, so ask for all of it up front
+		madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+		madvise(mapped, info.st_size, MADV_WILLNEED);
+
+		data = (const uint8_t *)mapped;
+		size = info.st_size;
+#endif
+
+		position = 0;
+
+		return 0;
+	}
+
+	/**
+	 * @brief Create an AVIOContext that reads from the mapping
+	 *
+	 * @return AVIOContext* The context, owned by this object, or nullptr on error
+	 */
+	AVIOContext *createContext()
+	{
+		if (data == nullptr)
+			return nullptr;
+
+		unsigned char *buffer = (unsigned char *)av_malloc(bufferSize);
+
+		if (buffer == nullptr)
+			return nullptr;
+
+		context = avio_alloc_context(buffer, bufferSize, 0, this, &MappedFile::read, nullptr, &MappedFile::seek);
+
+		if (context == nullptr)
+			av_free(buffer);
+
+		return context;
+	}
+
+	/**
+	 * @brief Free the AVIOContext and unmap the file
+	 *
+	 */
+	void close()
+	{
+		if (context != nullptr)
+		{
+			av_freep(&context->buffer);
+			avio_context_free(&context);
+		}
+
+#ifdef _WIN32
+		if (data != nullptr)
+			UnmapViewOfFile(data);
+
+		if (mapping != NULL)
+			CloseHandle(mapping);
+
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr)
+			munmap((void *)data, size);
+#endif
+
+		data = nullptr;
+		size = 0;
+		position = 0;
+	}
+
+	/**
+	 * @brief Check if a file is mapped
+	 *
+	 * @return true If a file is mapped
+	 * @return false Otherwise
+	 */
+	bool isOpen()
+	{
+		return data != nullptr;
+	}
+
+private:
+	static const int bufferSize = 64 * 1024; /**< Size of the AVIOContext buffer */
+
+	const uint8_t *data = nullptr;	   /**< Start of the mapping */
+	int64_t size = 0;				   /**< Size of the file in bytes */
+	int64_t position = 0;			   /**< Read position in bytes */
+	AVIOContext *context = nullptr;	   /**< Context reading from the mapping */
+
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE; /**< Handle of the file */
+	HANDLE mapping = NULL;				/**< Handle of the mapping */
+#endif
+
+	/**
+	 * @brief Read callback of the AVIOContext
+	 *
+	 * @param opaque The MappedFile
+	 * @param buffer Buffer to read into
+	 * @param bufferSize Size of the buffer
+	 * @return int Number of bytes read, or AVERROR_EOF at the end of the file
+	 */
+	static int read(void *opaque, uint8_t *buffer, int bufferSize)
+	{
+		MappedFile *mappedFile = (MappedFile *)opaque;
+		int64_t remaining = mappedFile->size - mappedFile->position;
+
+		if (remaining <= 0)
+			return AVERROR_EOF;
+
+		int count = remaining < bufferSize ? (int)remaining : bufferSize;
+
+		memcpy(buffer, mappedFile->data + mappedFile->position, count);
+		mappedFile->position += count;
+
+		return count;
+	}
+
+	/**
+	 * @brief Seek callback of the AVIOContext
+	 *
+	 * @param opaque The MappedFile
+	 * @param offset Offset to seek to
+	 * @param whence SEEK_SET, SEEK_CUR, SEEK_END or AVSEEK_SIZE
+	 * @return int64_t The new position, the size of the file for AVSEEK_SIZE, or a negative error code
+	 */
+	static int64_t seek(void *opaque, int64_t offset, int whence)
+	{
+		MappedFile *mappedFile = (MappedFile *)opaque;
+		int64_t target;
+
+		switch (whence & ~AVSEEK_FORCE)
+		{
+		case AVSEEK_SIZE:
+			return mappedFile->size;
+		case SEEK_SET:
+			target = offset;
+			break;
+		case SEEK_CUR:
+			target = mappedFile->position + offset;
+			break;
+		case SEEK_END:
+			target = mappedFile->size + offset;
+			break;
+		default:
+			return AVERROR(EINVAL);
+		}
+
+		if (target < 0 || target > mappedFile->size)
+			return AVERROR(EINVAL);
+
+		mappedFile->position = target;
+
+		return target;
+	}
+};
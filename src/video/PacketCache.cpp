@@ -0,0 +1,259 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#include <algorithm>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/**
+ * @brief Keeps the compressed video packets of short clips in memory, so that looping them does not touch the disk
+ *
+ * A loader records the packets of its first pass through a clip and stores them here once it reaches the end. From
+ * then on, it and every later loader of the same clip replay the packets into the decoder instead of demuxing the
+ * file. Clips are evicted least recently used first once the total size exceeds the cap. A loader that is still
+ * replaying an evicted clip keeps it alive until it is done with it. Clips are stamped with the size and modification
+ * time of their file like the palette cache, and dropped once the file on disk no longer matches.
+ */
+class PacketCache
+{
+public:
+	/**
+	 * @brief The packets of a single clip
+	 *
+	 */
+	struct Clip
+	{
+		std::vector<AVPacket *> packets; /**< Packets of the video stream, in demux order */
+		size_t size = 0;				 /**< Total size of the packets in bytes */
+		long long fileSize = -1;		 /**< Size of the file the packets were read from in bytes */
+		long long mtime = -1;			 /**< Modification time of the file the packets were read from in seconds */
+
+		~Clip()
+		{
+			for (AVPacket *packet : packets)
+				av_packet_free(&packet);
+		}
+	};
+
+	/**
+	 * @brief Get the cache shared by all loaders
+	 *
+	 * @return PacketCache& The cache
+	 */
+	static PacketCache &get()
+	{
+		static PacketCache cache;
+		return cache;
+	}
+
+	/**
+	 * @brief Set the maximum total size of the cached clips, evicting clips if needed
+	 *
+	 * @param maxSize Maximum size in bytes, 0 to disable the cache
+	 */
+	void setMaxSize(size_t maxSize)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		this->maxSize = maxSize;
+		trim();
+	}
+
+	/**
+	 * @brief Set the maximum size of a single clip, larger clips are read from disk every time
+	 *
+	 * @param maxClipSize Maximum size in bytes
+	 */
+	void setMaxClipSize(size_t maxClipSize)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->maxClipSize = maxClipSize;
+	}
+
+	/**
+	 * @brief Get the maximum size of a clip that can be cached
+	 *
+	 * @return size_t Maximum size in bytes, 0 if the cache is disabled
+	 */
+	size_t getMaxClipSize()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return std::min(maxClipSize, maxSize);
+	}
+
+	/**
+	 * @brief Get the total size of the cached clips
+	 *
+	 * @param clips Number of cached clips
+	 * @return size_t Total size in bytes
+	 */
+	size_t getSize(int &clips)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		clips = entries.size();
+		return size;
+	}
+
+	/**
+	 * @brief Get the identity of a file
+	 *
+	 * @param path Path to the file
+	 * @param size Size of the file in bytes
+	 * @param mtime Modification time of the file in seconds
+	 * @return true If the file exists
+	 * @return false If the file could not be found
+	 */
+	static bool identify(const std::string &path, long long &size, long long &mtime)
+	{
+		struct stat info;
+
+		if (stat(path.c_str(), &info) != 0)
+			return false;
+
+		size = info.st_size;
+		mtime = info.st_mtime;
+
+		return true;
+	}
+
+	/**
+	 * @brief Find the packets of a clip, marking it as recently used
+	 *
+	 * @param path Path to the video
+	 * @return std::shared_ptr<const Clip> The packets, or nullptr if the clip is not cached or its file has changed
+	 */
+	std::shared_ptr<const Clip> find(const std::string &path)
+	{
+		long long fileSize, mtime;
+
+		if (!identify(path, fileSize, mtime))
+			return nullptr;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (auto it = entries.begin(); it != entries.end(); it++)
+		{
+			if (it->path != path)
+				continue;
+
+			if (it->clip->fileSize != fileSize || it->clip->mtime != mtime)
+			{
+				remove(it);
+				return nullptr;
+			}
+
+			entries.splice(entries.begin(), entries, it);
+			return entries.front().clip;
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * @brief Store the packets of a clip, replacing packets of an older version of its file
+	 *
+	 * @param path Path to the video
+	 * @param clip The packets, stamped with the identity of the file they were read from, owned by the cache from now on
+	 * @return std::shared_ptr<const Clip> The stored packets, or nullptr if the clip is too large to cache
+	 */
+	std::shared_ptr<const Clip> store(const std::string &path, Clip *clip)
+	{
+		std::shared_ptr<const Clip> stored(clip);
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (clip->size > maxClipSize || clip->size > maxSize)
+			return nullptr;
+
+		for (auto it = entries.begin(); it != entries.end(); it++)
+		{
+			if (it->path != path)
+				continue;
+
+			// Another loader may have finished the same clip first
+			if (it->clip->fileSize == clip->fileSize && it->clip->mtime == clip->mtime)
+				return it->clip;
+
+			remove(it);
+			break;
+		}
+
+		entries.push_front({path, stored});
+		size += clip->size;
+		trim();
+
+		return stored;
+	}
+
+private:
+	/**
+	 * @brief A cached clip
+	 *
+	 */
+	struct Entry
+	{
+		std::string path;				  /**< Path to the video */
+		std::shared_ptr<const Clip> clip; /**< The packets */
+	};
+
+	std::mutex mutex;								/**< Guards the entries and sizes */
+	std::list<Entry> entries;						/**< Cached clips, most recently used first */
+	size_t size = 0;								/**< Total size of the cached clips in bytes */
+	size_t maxSize = (size_t)256 * 1024 * 1024;		/**< Maximum total size in bytes */
+	size_t maxClipSize = (size_t)32 * 1024 * 1024; /**< Maximum size of a single clip in bytes */
+
+	PacketCache()
+	{
+	}
+
+	/**
+	 * @brief Remove a cached clip (mutex must be held)
+	 *
+	 * @param it The entry of the clip
+	 */
+	void remove(std::list<Entry>::iterator it)
+	{
+		size -= it->clip->size;
+		entries.erase(it);
+	}
+
+	/**
+	 * @brief Evict the least recently used clips until the total size fits (mutex must be held)
+	 *
+	 */
+	void trim()
+	{
+		while (size > maxSize && !entries.empty())
+		{
+			size -= entries.back().clip->size;
+			entries.pop_back();
+		}
+	}
+};
@@ -0,0 +1,274 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <sys/stat.h>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../util/Logger.cpp"
+using namespace Util::Logger;
+
+using json = nlohmann::json;
+
+/**
+ * @brief A palette extracted from a single frame of a video
+ *
+ */
+struct PaletteKeyframe
+{
+	int64_t time;			   /**< Timestamp of the frame in microseconds */
+	std::vector<float> colors; /**< Colors extracted from the frame */
+};
+
+/**
+ * @brief Persists the palette of each video in a sidecar file next to it, so that it is only computed once
+ *
+ * The sidecar stores the size and modification time of the video it was computed from, and the version of the
+ * extraction that computed it. If any of these has changed, the entry is treated as a miss and the palette is computed
+ * again. Besides the palette of the first frame, the sidecar
+ * can hold a timeline of palettes computed offline every few frames, so that the palette follows the video.
+ */
+class PaletteCache
+{
+public:
+	/**
+	 * @brief Load the cached palette of a video
+	 *
+	 * @param videoPath Path to the video
+	 * @param colors Cached colors, only set on a hit
+	 * @return true If a valid palette was found
+	 * @return false If there is no palette or it is out of date
+	 */
+	static bool load(const std::string &videoPath, std::vector<float> &colors)
+	{
+		json data;
+
+		if (!read(videoPath, data))
+			return false;
+
+		try
+		{
+			std::vector<float> cached = data.at("colors").get<std::vector<float>>();
+
+			if (cached.size() != 3 * 5)
+				return false;
+
+			colors = cached;
+			return true;
+		}
+		catch (const std::exception &e)
+		{
+			return false;
+		}
+	}
+
+	/**
+	 * @brief Load the cached palette timeline of a video
+	 *
+	 * @param videoPath Path to the video
+	 * @param timeline Palettes ordered by time, only set on a hit
+	 * @return true If a valid timeline was found
+	 * @return false If there is no timeline or it is out of date
+	 */
+	static bool loadTimeline(const std::string &videoPath, std::vector<PaletteKeyframe> &timeline)
+	{
+		json data;
+
+		if (!read(videoPath, data))
+			return false;
+
+		try
+		{
+			std::vector<PaletteKeyframe> cached;
+
+			for (const json &entry : data.at("timeline"))
+			{
+				PaletteKeyframe keyframe;
+				keyframe.time = entry.at("time").get<int64_t>();
+				keyframe.colors = entry.at("colors").get<std::vector<float>>();
+
+				if (keyframe.colors.size() != 3 * 5)
+					return false;
+
+				cached.push_back(keyframe);
+			}
+
+			if (cached.size() == 0)
+				return false;
+
+			timeline = cached;
+			return true;
+		}
+		catch (const std::exception &e)
+		{
+			return false;
+		}
+	}
+
+	/**
+	 * @brief Store the palette of a video, keeping its timeline if it has one
+	 *
+	 * @param videoPath Path to the video
+	 * @param colors Colors extracted from the video
+	 */
+	static void store(const std::string &videoPath, const std::vector<float> &colors)
+	{
+		json data;
+		read(videoPath, data);
+
+		data["colors"] = colors;
+
+		write(videoPath, data);
+	}
+
+	/**
+	 * @brief Store the palette timeline of a video, which also sets its palette to that of the first keyframe
+	 *
+	 * @param videoPath Path to the video
+	 * @param timeline Palettes ordered by time
+	 */
+	static void storeTimeline(const std::string &videoPath, const std::vector<PaletteKeyframe> &timeline)
+	{
+		if (timeline.size() == 0)
+			return;
+
+		json data;
+		read(videoPath, data);
+
+		json entries = json::array();
+
+		for (const PaletteKeyframe &keyframe : timeline)
+			entries.push_back({{"time", keyframe.time}, {"colors", keyframe.colors}});
+
+		data["colors"] = timeline[0].colors;
+		data["timeline"] = entries;
+
+		write(videoPath, data);
+	}
+
+	/**
+	 * @brief Get the path of the sidecar file of a video
+	 *
+	 * @param videoPath Path to the video
+	 * @return std::string Path to the sidecar file
+	 */
+	static std::string getSidecarPath(const std::string &videoPath)
+	{
+		return videoPath + ".palette.json";
+	}
+
+private:
+	static const int version = 2; /**< Version of the palette extraction, increased whenever it gives different colors */
+
+	/**
+	 * @brief Read the sidecar of a video, if it is still valid
+	 *
+	 * @param videoPath Path to the video
+	 * @param data Contents of the sidecar, left empty if it is missing or out of date
+	 * @return true If the sidecar was read
+	 * @return false If it is missing, invalid or out of date
+	 */
+	static bool read(const std::string &videoPath, json &data)
+	{
+		long long size, mtime;
+
+		data = json::object();
+
+		if (!identify(videoPath, size, mtime))
+			return false;
+
+		std::ifstream file(getSidecarPath(videoPath));
+
+		if (!file.is_open())
+			return false;
+
+		try
+		{
+			json contents;
+			file >> contents;
+
+			if (contents.at("size").get<long long>() != size || contents.at("mtime").get<long long>() != mtime)
+				return false;
+
+			// Sidecars without a version were written by the palettegen filter, which orders colors differently
+			if (contents.value("version", 1) != version)
+				return false;
+
+			data = contents;
+			return true;
+		}
+		catch (const std::exception &e)
+		{
+			warn("VIDEO", "Ignoring invalid palette cache for " + videoPath);
+			return false;
+		}
+	}
+
+	/**
+	 * @brief Write the sidecar of a video, stamped with the video's current identity and the extraction version
+	 *
+	 * @param videoPath Path to the video
+	 * @param data Contents of the sidecar
+	 */
+	static void write(const std::string &videoPath, json &data)
+	{
+		long long size, mtime;
+
+		if (!identify(videoPath, size, mtime))
+			return;
+
+		data["size"] = size;
+		data["mtime"] = mtime;
+		data["version"] = version;
+
+		std::ofstream file(getSidecarPath(videoPath));
+
+		// The cache is an optimization only, so a read-only library just means the palette is computed every time
+		if (!file.is_open())
+			return;
+
+		file << data.dump();
+	}
+
+	/**
+	 * @brief Get the identity of a file
+	 *
+	 * @param path Path to the file
+	 * @param size Size of the file in bytes
+	 * @param mtime Modification time of the file in seconds
+	 * @return true If the file exists
+	 * @return false If the file could not be found
+	 */
+	static bool identify(const std::string &path, long long &size, long long &mtime)
+	{
+		struct stat info;
+
+		if (stat(path.c_str(), &info) != 0)
+			return false;
+
+		size = info.st_size;
+		mtime = info.st_mtime;
+
+		return true;
+	}
+};
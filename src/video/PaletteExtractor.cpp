@@ -0,0 +1,454 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "VideoFrameDescription.h"
+#include "HapUnpacker.cpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define PALETTE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PALETTE_TARGET_AVX2
+#else
+#define PALETTE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define PALETTE_NEON
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief Extracts a small palette from a frame with median cut on a subsampled grid of pixels
+ *
+ * Pixels are sampled straight from the planes handed to the viewer, converting YUV samples to RGB with the same
+ * coefficients as the shader and decoding single pixels from block-compressed frames. The pixels are then split into boxes, each time cutting the box with the largest error
+ * at the median of its widest channel, and each box contributes its mean color. The per-box statistics, which is where
+ * the time goes, are computed with AVX2 or NEON where available.
+ */
+class PaletteExtractor
+{
+public:
+	/**
+	 * @brief Extract a palette from a frame
+	 *
+	 * @param frame Frame to extract the palette from
+	 * @param nColors Number of colors to extract
+	 * @return std::vector<float> RGB triplets from 0 to 1, ordered from dark to light, or empty if the frame has no pixels
+	 */
+	static std::vector<float> extract(const VideoFrameDescription &frame, int nColors = 5)
+	{
+		std::vector<uint32_t> pixels = sample(frame);
+
+		if (pixels.size() == 0)
+			return std::vector<float>();
+
+		std::vector<Box> boxes;
+		boxes.push_back(measure(pixels, 0, pixels.size()));
+
+		while ((int)boxes.size() < nColors)
+		{
+			size_t largest = 0;
+
+			for (size_t i = 1; i < boxes.size(); i++)
+			{
+				if (boxes[i].error > boxes[largest].error)
+					largest = i;
+			}
+
+			Box box = boxes[largest];
+
+			if (box.error <= 0.0 || box.end - box.begin < 2)
+				break;
+
+			size_t median = box.begin + (box.end - box.begin) / 2;
+			int shift = box.channel * 8;
+
+			std::nth_element(pixels.begin() + box.begin, pixels.begin() + median, pixels.begin() + box.end,
+							 [shift](uint32_t a, uint32_t b)
+							 { return ((a >> shift) & 0xFF) < ((b >> shift) & 0xFF); });
+
+			boxes[largest] = measure(pixels, box.begin, median);
+			boxes.push_back(measure(pixels, median, box.end));
+		}
+
+		std::sort(boxes.begin(), boxes.end(), [](const Box &a, const Box &b)
+				  { return a.luminance() < b.luminance(); });
+
+		std::vector<float> colors;
+
+		for (int i = 0; i < nColors; i++)
+		{
+			// A frame with fewer distinct colors than requested repeats its lightest color
+			const Box &box = boxes[std::min(i, (int)boxes.size() - 1)];
+			float count = float(box.end - box.begin);
+
+			for (int c = 0; c < 3; c++)
+				colors.push_back(box.sum[c] / count / 255.0f);
+		}
+
+		return colors;
+	}
+
+private:
+	static const int maxSamples = 16384; /**< Maximum number of pixels sampled from a frame */
+
+	/**
+	 * @brief Accumulates the per-channel sum and sum of squares of packed pixels
+	 *
+	 */
+	typedef void (*StatsKernel)(const uint32_t *pixels, size_t count, uint64_t sum[3], uint64_t sumSquares[3]);
+
+	/**
+	 * @brief A range of pixels that is represented by a single color
+	 *
+	 */
+	struct Box
+	{
+		size_t begin;		 /**< First pixel of the box */
+		size_t end;			 /**< One past the last pixel of the box */
+		uint64_t sum[3];	 /**< Sum of each channel */
+		int channel;		 /**< Channel with the largest error, which the box is cut along */
+		double error;		 /**< Sum of squared deviations from the mean along that channel */
+
+		/**
+		 * @brief Get the luminance of the mean color, used to order the palette
+		 *
+		 * @return double Luminance from 0 to 255
+		 */
+		double luminance() const
+		{
+			return (0.2126 * sum[0] + 0.7152 * sum[1] + 0.0722 * sum[2]) / double(end - begin);
+		}
+	};
+
+	/**
+	 * @brief Sample a grid of pixels from a frame
+	 *
+	 * @param frame Frame to sample
+	 * @return std::vector<uint32_t> Pixels packed as 0x00BBGGRR
+	 */
+	static std::vector<uint32_t> sample(const VideoFrameDescription &frame)
+	{
+		std::vector<uint32_t> pixels;
+
+		if (frame.data == nullptr || frame.width <= 0 || frame.height <= 0)
+			return pixels;
+
+		int step = std::max(1, (int)std::ceil(std::sqrt(double(frame.width) * frame.height / maxSamples)));
+		pixels.reserve((frame.width / step + 1) * (frame.height / step + 1));
+
+		// Same conversion as the viewer's shader
+		float yScale = frame.fullRange ? 1.0f : 255.0f / 219.0f;
+		float yOffset = frame.fullRange ? 0.0f : 16.0f;
+		float cScale = frame.fullRange ? 1.0f : 255.0f / 224.0f;
+		float rv = frame.bt709 ? 1.5748f : 1.402f;
+		float gu = frame.bt709 ? 0.1873f : 0.3441f;
+		float gv = frame.bt709 ? 0.4681f : 0.7141f;
+		float bu = frame.bt709 ? 1.8556f : 1.772f;
+
+		if (frame.format == FrameFormatBC1 || frame.format == FrameFormatBC3)
+		{
+			for (int y = step / 2; y < frame.height; y += step)
+			{
+				for (int x = step / 2; x < frame.width; x += step)
+					pixels.push_back(HapUnpacker::decodePixel(frame.data, frame.stride, frame.format, x, y));
+			}
+
+			return pixels;
+		}
+
+		for (int y = step / 2; y < frame.height; y += step)
+		{
+			const unsigned char *row = frame.data + (size_t)y * frame.stride;
+
+			for (int x = step / 2; x < frame.width; x += step)
+			{
+				if (frame.format == FrameFormatRGB)
+				{
+					const unsigned char *p = row + x * 3;
+					pixels.push_back(p[0] | (p[1] << 8) | (p[2] << 16));
+					continue;
+				}
+
+				int u, v;
+
+				if (frame.format == FrameFormatYUV420P)
+				{
+					u = frame.chroma[0][(size_t)(y / 2) * frame.chromaStride[0] + x / 2];
+					v = frame.chroma[1][(size_t)(y / 2) * frame.chromaStride[1] + x / 2];
+				}
+				else
+				{
+					const unsigned char *uv = frame.chroma[0] + (size_t)(y / 2) * frame.chromaStride[0] + (x / 2) * 2;
+					u = uv[0];
+					v = uv[1];
+				}
+
+				float luma = (row[x] - yOffset) * yScale;
+				float cu = (u - 128.0f) * cScale;
+				float cv = (v - 128.0f) * cScale;
+
+				pixels.push_back(clamp(luma + rv * cv) | (clamp(luma - gu * cu - gv * cv) << 8) | (clamp(luma + bu * cu) << 16));
+			}
+		}
+
+		return pixels;
+	}
+
+	/**
+	 * @brief Round and clamp a channel value to a byte
+	 *
+	 * @param value Channel value from 0 to 255
+	 * @return uint32_t Clamped value
+	 */
+	static uint32_t clamp(float value)
+	{
+		return (uint32_t)std::min(255.0f, std::max(0.0f, value + 0.5f));
+	}
+
+	/**
+	 * @brief Compute the statistics of a range of pixels
+	 *
+	 * @param pixels All pixels
+	 * @param begin First pixel of the range
+	 * @param end One past the last pixel of the range
+	 * @return Box The range with its statistics
+	 */
+	static Box measure(const std::vector<uint32_t> &pixels, size_t begin, size_t end)
+	{
+		static const StatsKernel kernel = selectKernel();
+
+		Box box;
+		box.begin = begin;
+		box.end = end;
+		box.channel = 0;
+		box.error = 0.0;
+
+		uint64_t sumSquares[3];
+		kernel(pixels.data() + begin, end - begin, box.sum, sumSquares);
+
+		double count = double(end - begin);
+
+		for (int c = 0; c < 3; c++)
+		{
+			double error = sumSquares[c] - double(box.sum[c]) * box.sum[c] / count;
+
+			if (error > box.error)
+			{
+				box.error = error;
+				box.channel = c;
+			}
+		}
+
+		return box;
+	}
+
+	/**
+	 * @brief Pick the fastest statistics kernel the CPU supports
+	 *
+	 * @return StatsKernel The kernel
+	 */
+	static StatsKernel selectKernel()
+	{
+#if defined(PALETTE_AVX2)
+		if (hasAVX2())
+			return statsAVX2;
+#elif defined(PALETTE_NEON)
+		return statsNEON;
+#endif
+
+		return statsScalar;
+	}
+
+	/**
+	 * @brief Accumulate statistics one pixel at a time
+	 *
+	 */
+	static void statsScalar(const uint32_t *pixels, size_t count, uint64_t sum[3], uint64_t sumSquares[3])
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			sum[c] = 0;
+			sumSquares[c] = 0;
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				uint64_t value = (pixels[i] >> (c * 8)) & 0xFF;
+				sum[c] += value;
+				sumSquares[c] += value * value;
+			}
+		}
+	}
+
+#if defined(PALETTE_AVX2)
+	/**
+	 * @brief Check if the CPU and OS support AVX2
+	 *
+	 * @return true If AVX2 can be used
+	 * @return false Otherwise
+	 */
+	static bool hasAVX2()
+	{
+#ifdef _MSC_VER
+		int info[4];
+
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+			return false;
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+
+	/**
+	 * @brief Accumulate statistics eight pixels at a time
+	 *
+	 */
+	PALETTE_TARGET_AVX2 static void statsAVX2(const uint32_t *pixels, size_t count, uint64_t sum[3], uint64_t sumSquares[3])
+	{
+		const __m256i mask = _mm256_set1_epi32(0xFF);
+		size_t i = 0;
+
+		for (int c = 0; c < 3; c++)
+		{
+			sum[c] = 0;
+			sumSquares[c] = 0;
+		}
+
+		while (i + 8 <= count)
+		{
+			// Lanes are flushed to 64 bits often enough that the 32-bit sums of squares cannot overflow
+			size_t blockEnd = std::min(count, i + 65536);
+			__m256i sums[3], squares[3];
+
+			for (int c = 0; c < 3; c++)
+			{
+				sums[c] = _mm256_setzero_si256();
+				squares[c] = _mm256_setzero_si256();
+			}
+
+			for (; i + 8 <= blockEnd; i += 8)
+			{
+				__m256i v = _mm256_loadu_si256((const __m256i *)(pixels + i));
+
+				for (int c = 0; c < 3; c++)
+				{
+					__m256i channel = _mm256_and_si256(_mm256_srlv_epi32(v, _mm256_set1_epi32(c * 8)), mask);
+
+					sums[c] = _mm256_add_epi32(sums[c], channel);
+					// The upper 16 bits of each lane are zero, so this is channel * channel per lane
+					squares[c] = _mm256_add_epi32(squares[c], _mm256_madd_epi16(channel, channel));
+				}
+			}
+
+			for (int c = 0; c < 3; c++)
+			{
+				alignas(32) uint32_t lanes[8];
+
+				_mm256_store_si256((__m256i *)lanes, sums[c]);
+				for (int j = 0; j < 8; j++)
+					sum[c] += lanes[j];
+
+				_mm256_store_si256((__m256i *)lanes, squares[c]);
+				for (int j = 0; j < 8; j++)
+					sumSquares[c] += lanes[j];
+			}
+		}
+
+		uint64_t tailSum[3], tailSquares[3];
+		statsScalar(pixels + i, count - i, tailSum, tailSquares);
+
+		for (int c = 0; c < 3; c++)
+		{
+			sum[c] += tailSum[c];
+			sumSquares[c] += tailSquares[c];
+		}
+	}
+#endif
+
+#if defined(PALETTE_NEON)
+	/**
+	 * @brief Accumulate statistics four pixels at a time
+	 *
+	 */
+	static void statsNEON(const uint32_t *pixels, size_t count, uint64_t sum[3], uint64_t sumSquares[3])
+	{
+		const uint32x4_t mask = vdupq_n_u32(0xFF);
+		size_t i = 0;
+
+		for (int c = 0; c < 3; c++)
+		{
+			sum[c] = 0;
+			sumSquares[c] = 0;
+		}
+
+		while (i + 4 <= count)
+		{
+			// Lanes are flushed to 64 bits often enough that the 32-bit sums of squares cannot overflow
+			size_t blockEnd = std::min(count, i + 65536);
+			uint32x4_t sums[3], squares[3];
+
+			for (int c = 0; c < 3; c++)
+			{
+				sums[c] = vdupq_n_u32(0);
+				squares[c] = vdupq_n_u32(0);
+			}
+
+			for (; i + 4 <= blockEnd; i += 4)
+			{
+				uint32x4_t v = vld1q_u32(pixels + i);
+				uint32x4_t channels[3] = {vandq_u32(v, mask), vandq_u32(vshrq_n_u32(v, 8), mask), vandq_u32(vshrq_n_u32(v, 16), mask)};
+
+				for (int c = 0; c < 3; c++)
+				{
+					sums[c] = vaddq_u32(sums[c], channels[c]);
+					squares[c] = vmlaq_u32(squares[c], channels[c], channels[c]);
+				}
+			}
+
+			for (int c = 0; c < 3; c++)
+			{
+				sum[c] += vaddlvq_u32(sums[c]);
+				sumSquares[c] += vaddlvq_u32(squares[c]);
+			}
+		}
+
+		uint64_t tailSum[3], tailSquares[3];
+		statsScalar(pixels + i, count - i, tailSum, tailSquares);
+
+		for (int c = 0; c < 3; c++)
+		{
+			sum[c] += tailSum[c];
+			sumSquares[c] += tailSquares[c];
+		}
+	}
+#endif
+};
@@ -0,0 +1,171 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief Steps of the quality ladder, each one decoding cheaper than the one before and including it
+ *
+ */
+enum QualityLevel
+{
+	QualityFull,			 /**< Decode every frame in full */
+	QualitySkipLoopFilter,	 /**< Skip the deblocking loop filter */
+	QualitySkipNonReference, /**< Also discard frames that no other frame refers to */
+	QualityLowRes,			 /**< Also decode at half resolution, for codecs that support it */
+	QualityHalfRate,		 /**< Also show only every other frame */
+	NumQualityLevels
+};
+
+/**
+ * @brief Chooses how cheaply a loader decodes, from how long decoding takes compared to the time the frames cover
+ *
+ * The load is the share of real time spent decoding and converting, averaged over recent frames. Above a high
+ * watermark the ladder steps down, below a low watermark it steps back up. Every step has to be held for a while
+ * before the next one, so the ladder does not oscillate between two steps.
+ */
+class QualityLadder
+{
+public:
+	/**
+	 * @brief Get the name of a step, to show in the UI
+	 *
+	 * @param level The step
+	 * @return const char* The name
+	 */
+	static const char *getName(int level)
+	{
+		static const char *names[] = {"Full", "No loop filter", "Reference frames only", "Low resolution", "Half frame rate"};
+
+		return level >= 0 && level < NumQualityLevels ? names[level] : "";
+	}
+
+	/**
+	 * @brief Set whether the ladder may step down at all, stepping back to full quality if not
+	 *
+	 * @param enabled Whether to adapt
+	 */
+	void setEnabled(bool enabled)
+	{
+		this->enabled = enabled;
+
+		if (!enabled)
+			reset();
+	}
+
+	/**
+	 * @brief Set whether a step can be taken for the current video, which is otherwise skipped
+	 *
+	 * @param level The step
+	 * @param available Whether it has any effect
+	 */
+	void setAvailable(int level, bool available)
+	{
+		this->available[level] = available;
+
+		if (!available && this->level == level)
+			this->level = next(level, -1);
+	}
+
+	/**
+	 * @brief Go back to full quality and forget the measured load
+	 *
+	 */
+	void reset()
+	{
+		level = QualityFull;
+		load = 0.0f;
+		framesAtLevel = 0;
+	}
+
+	/**
+	 * @brief Add the time spent on a frame, and step the ladder if needed
+	 *
+	 * @param elapsed Time spent decoding and converting in microseconds
+	 * @param covered Duration of the frames that were decoded in that time, in microseconds
+	 * @return true If the step changed
+	 * @return false Otherwise
+	 */
+	bool measure(int64_t elapsed, int64_t covered)
+	{
+		if (!enabled || covered <= 0)
+			return false;
+
+		load = 0.95f * load + 0.05f * (float)elapsed / (float)covered;
+		framesAtLevel++;
+
+		int step = 0;
+
+		if (load > highLoad && framesAtLevel >= framesBeforeDown)
+			step = 1;
+		else if (load < lowLoad && framesAtLevel >= framesBeforeUp)
+			step = -1;
+
+		int stepped = step != 0 ? next(level, step) : level;
+
+		if (stepped == level)
+			return false;
+
+		level = stepped;
+		framesAtLevel = 0;
+
+		return true;
+	}
+
+	/**
+	 * @brief Get the current step
+	 *
+	 * @return int The step, see QualityLevel
+	 */
+	int getLevel()
+	{
+		return level;
+	}
+
+private:
+	static constexpr float highLoad = 0.85f;	/**< Load above which the ladder steps down */
+	static constexpr float lowLoad = 0.5f;		/**< Load below which the ladder steps back up */
+	static const int framesBeforeDown = 30;		/**< Frames a step is held before stepping down further */
+	static const int framesBeforeUp = 180;		/**< Frames a step is held before stepping back up */
+
+	bool enabled = true;												/**< Whether the ladder adapts */
+	bool available[NumQualityLevels] = {true, true, true, true, true}; /**< Whether each step has an effect */
+	int level = QualityFull;											/**< Current step */
+	float load = 0.0f;													/**< Share of real time spent decoding, averaged */
+	int framesAtLevel = 0;												/**< Frames measured since the last step */
+
+	/**
+	 * @brief Find the next available step in a direction
+	 *
+	 * @param from The step to start from
+	 * @param direction 1 to step down in quality, -1 to step up
+	 * @return int The next available step, or from if there is none
+	 */
+	int next(int from, int direction)
+	{
+		for (int l = from + direction; l >= QualityFull && l < NumQualityLevels; l += direction)
+		{
+			if (available[l])
+				return l;
+		}
+
+		return direction < 0 ? QualityFull : from;
+	}
+};
@@ -18,6 +18,23 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #pragma once
 
+#include <cstdint>
+
+struct AVFrame;
+
+/**
+ * @brief Pixel layouts a frame can be handed to the viewer in
+ *
+ */
+enum VideoFrameFormat
+{
+	FrameFormatRGB,		/**< Packed RGB24 */
+	FrameFormatYUV420P, /**< Planar YUV 4:2:0, three planes */
+	FrameFormatNV12,	/**< Semi-planar YUV 4:2:0, luma plane and interleaved chroma plane */
+	FrameFormatBC1,		/**< BC1 (DXT1) compressed RGB blocks, stride is the number of bytes per row of blocks */
+	FrameFormatBC3,		/**< BC3 (DXT5) compressed RGBA blocks, stride is the number of bytes per row of blocks */
+};
+
 /**
  * @brief Stores a video frame description
  *
@@ -27,5 +44,21 @@ struct VideoFrameDescription
 	unsigned char *data; /**< Data of the frame */
 	int width;			 /**< Width of the frame */
 	int height;			 /**< Height of the frame */
+	int stride;			 /**< Bytes per row of the frame */
 	bool ready;			 /**< Whether the frame is ready */
+
+	int format = FrameFormatRGB;		   /**< Pixel layout of the frame, see VideoFrameFormat */
+	unsigned char *chroma[2] = {nullptr}; /**< Chroma planes of YUV frames, only the first is used for NV12 */
+	int chromaStride[2] = {0};			   /**< Bytes per row of the chroma planes */
+	bool bt709 = false;					   /**< Whether YUV frames use BT.709 rather than BT.601 coefficients */
+	bool fullRange = false;				   /**< Whether YUV frames use the full 0-255 range rather than 16-235 */
+
+	AVFrame *frame = nullptr; /**< Reference-counted frame that owns the data, released by the consumer */
+	int generation = 0;		  /**< Load/rewind generation the frame was decoded in */
+	int64_t time = 0;		  /**< Presentation time in microseconds, which keeps increasing when the video loops */
+	int64_t duration = 0;	  /**< Display duration in microseconds */
+	int loopClip = 0;		  /**< Identifies the loop the frame belongs to, 0 if it is not numbered */
+	int loopFrame = -1;		  /**< Index of the frame within a pass through the video from the start */
+	int loopLength = 0;		  /**< Number of frames in a pass, 0 if unknown */
+	float colors[3 * 5];	  /**< Colors extracted from the video */
 };
@@ -24,15 +24,26 @@ extern "C"
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
 #include "libswscale/swscale.h"
-#include "libavfilter/avfilter.h"
-#include "libavfilter/buffersrc.h"
-#include "libavfilter/buffersink.h"
 #include "libavutil/opt.h"
 }
 
 #include "VideoFrameDescription.h"
+#include "FrameConverter.cpp"
+#include "DecoderThreadBudget.cpp"
+#include "DecoderPool.cpp"
+#include "PaletteCache.cpp"
+#include "PaletteExtractor.cpp"
+#include "MappedFile.cpp"
+#include "HapUnpacker.cpp"
+#include "KeyframeIndex.cpp"
+#include "PacketCache.cpp"
+#include "QualityLadder.cpp"
 #include "../util/Logger.cpp"
 using namespace Util::Logger;
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -47,304 +58,1124 @@ using namespace Util::Logger;
 class VideoLoader
 {
 private:
+	/**
+	 * @brief Time and colors of a frame in a pass through the video
+	 *
+	 */
+	struct LoopFrame
+	{
+		int64_t time;		 /**< Time within the clip in microseconds */
+		int64_t duration;	 /**< Display duration in microseconds */
+		float colors[3 * 5]; /**< Colors of the frame */
+	};
+
 	std::vector<float> colors; /**< Colors extracted from the video */
+	std::string path;		   /**< Path of the loaded video */
+	std::vector<PaletteKeyframe> timeline; /**< Precomputed palettes ordered by time, empty if there are none */
 	bool used = false;		   /**< Whether the video loader has been used */
-	bool usedFrame = false;	   /**< Whether the frame has been used */
+
+	AVFormatContext *format = nullptr;	/**< Format context */
+	AVCodecParameters *codecParameters; /**< Codec parameters */
+	const AVCodec *codec;				/**< Codec */
+	AVCodecContext *context = nullptr;	/**< Codec context */
+	AVCodecParserContext *parser = nullptr; /**< Parser context, only used for raw elementary streams */
+	AVPacket *packet = nullptr;			/**< Packet */
+	AVFrame *frame = nullptr;			/**< Frame */
+	AVFrame *displayFrame = nullptr;	/**< Converted frame */
+	FrameConverter converter;			/**< Converts decoded frames for display */
+	int videoStreamIndex;				/**< Video stream index */
+	int status = 0;						/**< Status */
+
+	int requestedThreads = 0;  /**< Number of decoder threads requested, 0 for a fair share of the budget */
+	bool lowLatency = false;   /**< Whether to use slice threading only, which adds no frame delay */
+	int grantedThreads = 0;	   /**< Number of decoder threads claimed from the budget */
+	int decoderThreads = 0;	   /**< Number of threads the decoder was opened with */
+	int decoderThreadType = 0; /**< Threading type the decoder was opened with */
+	bool budgeted = true;	   /**< Whether decoder threads are claimed from the budget on load */
+
+	bool memoryMapped = false; /**< Whether the video is read through a memory mapping */
+	MappedFile mappedFile;	   /**< Mapping of the video, if memoryMapped is set */
+
+	const std::atomic<bool> *interruptFlag = nullptr; /**< Aborts blocking FFmpeg calls while set, nullptr for none */
+
+	int blockFormat = -1;				/**< FrameFormatBC1 or FrameFormatBC3 if HAP frames are unpacked instead of decoded, -1 otherwise */
+	AVBufferPool *blockPool = nullptr; /**< Buffers for unpacked blocks, which are all the same size */
+
+	static const int maxDropsInARow = 8; /**< Maximum number of late frames dropped in a row */
+
+	VideoFrameDescription warmFrame; /**< First frame, decoded ahead of time by warmUp */
+	bool hasWarmFrame = false;		 /**< Whether warmFrame holds a frame that has not been handed out yet */
+
+	std::vector<VideoFrameDescription> head; /**< The first frames of the video, kept so that rewinding is instant */
+	size_t headLength = 8;					 /**< Number of frames to keep in the head */
+	size_t headPosition = 0;				 /**< Next head frame to serve, equal to the head size when not serving */
+	bool headComplete = false;				 /**< Whether the head has stopped growing */
+	bool wholeClip = false;					 /**< Whether the head holds every frame of the video */
+	size_t framesToSkip = 0;				 /**< Frames the decoder still has to decode and drop to catch up with the head */
+
+	int64_t startTime = 0;	   /**< Start time of the video stream in microseconds */
+	int64_t clipTime = 0;	   /**< Time of the last decoded frame within the clip, in microseconds */
+	int64_t loopOffset = 0;	   /**< Added to clip times so that presentation times keep increasing across loops */
+	int64_t lastTime = 0;	   /**< Presentation time of the last frame that was decoded or served */
+	int64_t lastDuration = 0;  /**< Duration of that frame */
+	int droppedFrames = 0;	   /**< Frames dropped for being late since the last call to takeDroppedFrames */
+	int droppedInARow = 0;	   /**< Frames dropped in a row, bounded so that a slow decoder still shows something */
+
+	std::shared_ptr<const PacketCache::Clip> cachedPackets; /**< Packets of the video if it is in the packet cache */
+	size_t replayPosition = 0;								/**< Next cached packet to send to the decoder */
+	PacketCache::Clip *recording = nullptr;					/**< Packets read so far in a pass from the start, to be cached at the end */
+	bool recordPackets = false;								/**< Whether passes from the start are recorded, until the clip turns out too large */
+
+	KeyframeIndex keyframes;		 /**< Keyframes of the video, for seeking */
+	int64_t seekTarget = INT64_MIN; /**< Time within the clip that frames are decoded up to without being shown after a seek */
+
+	static const int maxLoopFrames = 600; /**< Maximum number of frames of a loop the viewer can hold on the GPU */
+
+	int loopClip = 0;				   /**< Identifies this load of the video to the viewer, which can hold its frames on the GPU */
+	int loopLength = 0;				   /**< Number of frames in a pass from the start, 0 while unknown, -1 if there are too many */
+	int estimatedLength = 0;		   /**< Number of frames the container reports, given to the viewer until loopLength is known */
+	int passFrame = 0;				   /**< Index of the next frame in the current pass, -1 if the pass did not start at the beginning */
+	std::vector<LoopFrame> loopFrames; /**< Time and colors of each frame in a pass, to play it without decoding */
+	int residentLoop = 0;			   /**< Loop that the viewer holds every frame of */
+	bool resident = false;			   /**< Whether the current pass is played from the frames the viewer holds */
+
+	QualityLadder ladder;		/**< Chooses how cheaply to decode when decoding falls behind */
+	bool halfRateSkip = false; /**< Whether the next frame is skipped at half frame rate */
+
+public:
+	/**
+	 * @brief Construct a new VideoLoader object
+	 *
+	 */
+	VideoLoader()
+	{
+		static bool initialized = false;
+
+		if (!initialized)
+		{
+			initialized = true;
+			av_log_set_level(AV_LOG_QUIET);
+			print("VIDEO", "FFmpeg version: " + std::string(av_version_info()));
+		}
+
+		converter.setNativeYUV(true);
+	}
+
+	~VideoLoader()
+	{
+		if (used)
+		{
+			getReadyForNextLoad();
+		}
+	}
+
+	/**
+	 * @brief Set the resolution decoded frames are scaled down to, never scaling up beyond the source
+	 *
+	 * @param width Target width, 0 for the source width
+	 * @param height Target height, 0 for the source height
+	 */
+	void setTargetSize(int width, int height)
+	{
+		converter.setTargetSize(width, height);
+	}
+
+	/**
+	 * @brief Configure decoder threading, applied on the next load
+	 *
+	 * @param threads Number of decoder threads, 0 for a fair share of the global budget
+	 * @param sliceOnly Whether to use slice threading only, avoiding the frame delay of frame threading
+	 */
+	void setThreading(int threads, bool sliceOnly)
+	{
+		requestedThreads = threads;
+		lowLatency = sliceOnly;
+	}
+
+	/**
+	 * @brief Set a flag that aborts opening, probing and reading the video while it is set
+	 *
+	 * A newer request can then cancel a load that is stuck on a slow drive, instead of waiting for it to finish.
+	 *
+	 * @param flag The flag, which has to outlive the loader, or nullptr for none
+	 */
+	void setInterrupt(const std::atomic<bool> *flag)
+	{
+		interruptFlag = flag;
+	}
+
+	/**
+	 * @brief Interrupt callback of the demuxer
+	 *
+	 * @param opaque The VideoLoader
+	 * @return int 1 to abort the blocking call, 0 to continue
+	 */
+	static int interrupt(void *opaque)
+	{
+		VideoLoader *videoLoader = (VideoLoader *)opaque;
+
+		return videoLoader->interruptFlag != nullptr && *videoLoader->interruptFlag ? 1 : 0;
+	}
+
+	/**
+	 * @brief Tell the loader which loop the viewer holds every frame of, which is then played without decoding from the next pass on
+	 *
+	 * @param loop The loop, as numbered in the frames, or 0 for none
+	 */
+	void setResidentLoop(int loop)
+	{
+		residentLoop = loop;
+	}
+
+	/**
+	 * @brief Set whether decoding gets cheaper automatically when it cannot keep up
+	 *
+	 * @param adaptive Whether to step down the quality ladder under load
+	 */
+	void setAdaptiveQuality(bool adaptive)
+	{
+		ladder.setEnabled(adaptive);
+	}
+
+	/**
+	 * @brief Get the step of the quality ladder the video is decoded at
+	 *
+	 * @return int The step, see QualityLevel
+	 */
+	int getQuality()
+	{
+		return ladder.getLevel();
+	}
+
+	/**
+	 * @brief Set whether videos are read through a memory mapping instead of FFmpeg's file protocol, applied on the next load
+	 *
+	 * @param memoryMapped Whether to map videos into memory
+	 */
+	void setMemoryMapped(bool memoryMapped)
+	{
+		this->memoryMapped = memoryMapped;
+	}
+
+	/**
+	 * @brief Set whether decoder threads are claimed from the global budget on load
+	 *
+	 * Loaders that are opened ahead of time are not budgeted, since an idle decoder uses no cores. They use the
+	 * share they would have been granted, and claim it with claimThreads once they start playing.
+	 *
+	 * @param budgeted Whether to claim threads on load
+	 */
+	void setBudgeted(bool budgeted)
+	{
+		this->budgeted = budgeted;
+	}
+
+	/**
+	 * @brief Claim the threads of an unbudgeted decoder from the global budget, once it starts playing
+	 *
+	 */
+	void claimThreads()
+	{
+		budgeted = true;
+
+		if (status != 1 || grantedThreads > 0 || context == nullptr)
+			return;
+
+		grantedThreads = context->thread_count;
+		DecoderThreadBudget::get().claim(grantedThreads);
+	}
+
+	/**
+	 * @brief Decode the first frame ahead of time, so that the first call to getFrame returns immediately
+	 *
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	int warmUp()
+	{
+		warmFrame = getFrame();
+		hasWarmFrame = warmFrame.ready;
+
+		return hasWarmFrame ? 0 : -1;
+	}
+
+	/**
+	 * @brief Get the status of the video loader
+	 *
+	 * @return int Status
+	 */
+	int getStatus()
+	{
+		return status;
+	}
+
+	/**
+	 * @brief Rewind the video
+	 *
+	 * The next frames are served from the cached head, while the decoder seeks back to the start and catches up
+	 * behind them. Clips that fit in the head entirely are not decoded again at all.
+	 */
+	void rewind()
+	{
+		headPosition = 0;
+		loopOffset = lastTime + lastDuration;
+		seekTarget = INT64_MIN;
+		passFrame = 0;
+
+		// A loop the viewer holds entirely is played by index, leaving the decoder where it is until the loop is dropped
+		resident = loopLength > 0 && residentLoop == loopClip;
+
+		if (wholeClip || resident)
+			return;
+
+		if (context != nullptr)
+			avcodec_flush_buffers(context);
+
+		applyLowres();
+
+		if (cachedPackets != nullptr)
+		{
+			replayPosition = 0;
+		}
+		else
+		{
+			av_seek_frame(format, videoStreamIndex, 0, AVSEEK_FLAG_BACKWARD);
+
+			// A pass that was cut short by a rewind or seek starts recording over
+			if (recordPackets)
+				startRecording();
+		}
+
+		framesToSkip = head.size();
+	}
+
+	/**
+	 * @brief Seek to a time within the clip
+	 *
+	 * The demuxer jumps to the keyframe before the target, and the frames from there up to the target are decoded but
+	 * not converted or shown, so a seek costs at most one GOP of decoding. Clips that fit in the head entirely are
+	 * served from it instead.
+	 *
+	 * @param time Time within the clip in microseconds
+	 */
+	void seek(int64_t time)
+	{
+		if (hasWarmFrame)
+		{
+			av_frame_free(&warmFrame.frame);
+			hasWarmFrame = false;
+		}
+
+		int64_t duration = getDuration();
+		time = std::max((int64_t)0, duration > 0 ? std::min(time, duration - 1) : time);
+
+		if (resident)
+		{
+			passFrame = 0;
+
+			while (passFrame + 1 < loopLength && loopFrames[passFrame + 1].time <= time)
+				passFrame++;
+
+			loopOffset = lastTime + lastDuration - loopFrames[passFrame].time;
+			return;
+		}
+
+		if (wholeClip)
+		{
+			headPosition = 0;
+
+			while (headPosition + 1 < head.size() && head[headPosition + 1].time <= time)
+				headPosition++;
+
+			loopOffset = lastTime + lastDuration - head[headPosition].time;
+			passFrame = headPosition;
+			return;
+		}
+
+		// Frames are only numbered in passes from the start
+		passFrame = -1;
+
+		// Presentation times keep increasing, as they do when the clip loops
+		loopOffset = lastTime + lastDuration - time;
+
+		// The head has to be an unbroken run of frames from the start, so it stops growing here
+		headComplete = true;
+		headPosition = head.size();
+		framesToSkip = 0;
+
+		if (context != nullptr)
+			avcodec_flush_buffers(context);
+
+		applyLowres();
+
+		int64_t timestamp = av_rescale_q(time + startTime, AV_TIME_BASE_Q, format->streams[videoStreamIndex]->time_base);
+		seekTarget = time;
+
+		// Cached clips know their keyframes already
+		if (cachedPackets != nullptr)
+		{
+			replayPosition = 0;
+
+			for (size_t i = 0; i < cachedPackets->packets.size(); i++)
+			{
+				const AVPacket *cached = cachedPackets->packets[i];
+
+				if ((cached->flags & AV_PKT_FLAG_KEY) && cached->pts != AV_NOPTS_VALUE && cached->pts <= timestamp)
+					replayPosition = i;
+			}
+
+			return;
+		}
+
+		// The pass no longer starts at the beginning, so it cannot be cached until the next rewind
+		stopRecording();
+
+		// Until a background scan of a container without an index is done, the demuxer estimates where to go
+		if (!keyframes.isLoaded())
+			KeyframeScanner::get().find(path, keyframes);
+
+		if (!keyframes.isLoaded() || keyframes.seek(format, videoStreamIndex, timestamp) < 0)
+			av_seek_frame(format, videoStreamIndex, timestamp, AVSEEK_FLAG_BACKWARD);
+	}
+
+	/**
+	 * @brief Get the duration of the video
+	 *
+	 * @return int64_t Duration in microseconds, 0 if unknown
+	 */
+	int64_t getDuration()
+	{
+		AVStream *stream = format->streams[videoStreamIndex];
+
+		if (stream->duration != AV_NOPTS_VALUE && stream->duration > 0)
+			return av_rescale_q(stream->duration, stream->time_base, AV_TIME_BASE_Q);
+
+		return format->duration != AV_NOPTS_VALUE ? std::max((int64_t)0, format->duration) : 0;
+	}
+
+	/**
+	 * @brief Get the duration of a single frame, derived from the stream's frame rate
+	 *
+	 * @return int64_t Frame duration in microseconds
+	 */
+	int64_t getFrameDuration()
+	{
+		AVRational frameRate = format->streams[videoStreamIndex]->r_frame_rate;
+
+		if (frameRate.num == 0)
+			return 1000000 / 30;
+
+		return float(frameRate.den) / float(frameRate.num) * 1000000.0f;
+	}
+
+	/**
+	 * @brief Decode the next frame of the video into frame
+	 *
+	 * @return int 0 if a frame was decoded, 1 if the end of the video was reached, -1 on error
+	 */
+	int decodeFrame()
+	{
+		if (blockFormat >= 0)
+			return unpackFrame();
+
+		av_frame_unref(frame);
+
+		while (true)
+		{
+			int ret = avcodec_receive_frame(context, frame);
+
+			if (ret == 0)
+				return 0;
+
+			if (ret == AVERROR_EOF)
+				return 1;
+
+			if (ret != AVERROR(EAGAIN))
+			{
+				error("VIDEO", "Error while receiving frame");
+				return -1;
+			}
+
+			av_packet_unref(packet);
+
+			// An interrupted read is not the end of the video, and a pass would never end on it
+			if (interrupt(this))
+				return -1;
+
+			int read = readPacket();
+
+			if (read < 0)
+			{
+				if (read != AVERROR_EOF)
+				{
+					error("VIDEO", "Error while reading packet");
+					return -1;
+				}
+
+				// Drain the frames the decoder is still holding before reporting the end of the video
+				avcodec_send_packet(context, nullptr);
+				continue;
+			}
+
+			// Demuxed packets already hold exactly one frame, so they go to the decoder as they are
+			if (parser == nullptr)
+			{
+				if (avcodec_send_packet(context, packet) < 0)
+				{
+					error("VIDEO", "Error while sending packet");
+					return -1;
+				}
+
+				continue;
+			}
+
+			if (parsePacket() < 0)
+				return -1;
+		}
+	}
+
+	/**
+	 * @brief Read the next packet of the video stream into packet, replaying it from the packet cache if possible
+	 *
+	 * Packets read from the file are recorded while the pass started at the beginning of the video, and the recording
+	 * goes into the cache when the pass reaches the end.
+	 *
+	 * @return int 0 if successful, a negative value at the end of the video or on error
+	 */
+	int readPacket()
+	{
+		if (cachedPackets != nullptr)
+		{
+			if (replayPosition >= cachedPackets->packets.size())
+				return AVERROR_EOF;
+
+			return av_packet_ref(packet, cachedPackets->packets[replayPosition++]);
+		}
+
+		while (true)
+		{
+			int ret = av_read_frame(format, packet);
+
+			if (ret == AVERROR_EOF && recording != nullptr && recording->packets.size() > 0)
+			{
+				cachedPackets = PacketCache::get().store(path, recording);
+				replayPosition = cachedPackets != nullptr ? cachedPackets->packets.size() : 0;
+				recording = nullptr;
+				recordPackets = false;
+			}
+
+			if (ret < 0)
+				return ret;
+
+			// Only demuxers that cannot skip discarded streams still return their packets
+			if (packet->stream_index == videoStreamIndex)
+				break;
+
+			av_packet_unref(packet);
+		}
+
+		if (recording != nullptr)
+		{
+			AVPacket *copy = av_packet_clone(packet);
+
+			if (copy != nullptr)
+			{
+				recording->packets.push_back(copy);
+				recording->size += packet->size;
+			}
+
+			// Clips that are too large are read from the file on every pass
+			if (copy == nullptr || recording->size > PacketCache::get().getMaxClipSize())
+			{
+				recordPackets = false;
+				stopRecording();
+			}
+		}
+
+		return 0;
+	}
+
+	/**
+	 * @brief Start recording the packets of a pass from the start of the video, discarding any earlier recording
+	 *
+	 */
+	void startRecording()
+	{
+		delete recording;
+		recording = PacketCache::get().getMaxClipSize() > 0 ? new PacketCache::Clip() : nullptr;
+
+		// The recording is stamped before the first packet is read, so a file replaced during the pass is not mistaken for it
+		if (recording != nullptr && !PacketCache::identify(path, recording->fileSize, recording->mtime))
+			stopRecording();
+	}
+
+	/**
+	 * @brief Stop recording packets, discarding the recording
+	 *
+	 */
+	void stopRecording()
+	{
+		delete recording;
+		recording = nullptr;
+	}
+
+	/**
+	 * @brief Unpack the blocks of the next HAP frame into frame, skipping the decoder and color conversion entirely
+	 *
+	 * @return int 0 if a frame was unpacked, 1 if the end of the video was reached, -1 on error
+	 */
+	int unpackFrame()
+	{
+		av_frame_unref(frame);
+		av_packet_unref(packet);
+
+		if (interrupt(this))
+			return -1;
+
+		int read = readPacket();
+
+		if (read == AVERROR_EOF)
+			return 1;
+
+		if (read < 0)
+		{
+			error("VIDEO", "Error while reading packet");
+			return -1;
+		}
+
+		frame->buf[0] = av_buffer_pool_get(blockPool);
+
+		if (frame->buf[0] == nullptr)
+		{
+			error("VIDEO", "Could not allocate blocks");
+			return -1;
+		}
+
+		frame->data[0] = frame->buf[0]->data;
+		frame->linesize[0] = HapUnpacker::getStride(blockFormat, codecParameters->width);
+		frame->width = codecParameters->width;
+		frame->height = codecParameters->height;
+		frame->best_effort_timestamp = packet->pts;
+		frame->pts = packet->pts;
+		frame->duration = packet->duration;
+
+		if (HapUnpacker::unpack(packet->data, packet->size, frame->data[0], frame->buf[0]->size) < 0)
+		{
+			error("VIDEO", "Could not unpack HAP frame");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * @brief Check if a HAP video can be unpacked straight to compressed textures, by looking at its first frame
+	 *
+	 * @return int FrameFormatBC1 or FrameFormatBC3 if it can, -1 if it has to be decoded
+	 */
+	int probeBlockFormat()
+	{
+		AVPacket *probe = av_packet_alloc();
+		int result = -1;
+
+		while (probe != nullptr && av_read_frame(format, probe) >= 0)
+		{
+			bool isVideo = probe->stream_index == videoStreamIndex;
+
+			if (isVideo)
+				result = HapUnpacker::probe(probe->data, probe->size);
+
+			av_packet_unref(probe);
+
+			if (isVideo)
+				break;
+		}
+
+		av_packet_free(&probe);
+		av_seek_frame(format, videoStreamIndex, 0, AVSEEK_FLAG_BACKWARD);
+
+		return result;
+	}
+
+	/**
+	 * @brief Split the packet of a raw elementary stream into frames and send them to the decoder
+	 *
+	 * @return int 0 if successful, -1 on error
+	 */
+	int parsePacket()
+	{
+		uint8_t *data = packet->data;
+		int dataSize = packet->size;
+		int64_t pts = packet->pts;
+		int64_t dts = packet->dts;
+
+		while (dataSize > 0)
+		{
+			int ret = av_parser_parse2(parser, context, &packet->data, &packet->size, data, dataSize, pts, dts, packet->pos);
+
+			if (ret < 0)
+			{
+				error("VIDEO", "Error while parsing");
+				return -1;
+			}
+
+			data += ret;
+			dataSize -= ret;
+
+			if (packet->size)
+			{
+				packet->pts = parser->pts;
+				packet->dts = parser->dts;
+
+				if (avcodec_send_packet(context, packet) < 0)
+				{
+					error("VIDEO", "Error while sending packet");
+					return -1;
+				}
+			}
+		}
+
+		return 0;
+	}
 
 	/**
-	 * @brief Convert a frame to RGB
+	 * @brief Serve the next frame of the cached head, letting the decoder catch up by one frame behind it
 	 *
-	 * @param frame Frame to convert
-	 * @param rgb_frame Converted frame
-	 * @return int 0 if successful, -1 otherwise
+	 * @return VideoFrameDescription Frame description, referencing the cached frame
 	 */
-	int convertToRGB(AVFrame *frame, AVFrame **rgb_frame)
+	VideoFrameDescription nextHeadFrame()
 	{
-		// Allocate an AVFrame structure
-		*rgb_frame = av_frame_alloc();
-		if (*rgb_frame == NULL)
-		{
-			fprintf(stderr, "Could not allocate RGB frame\n");
-			return -1;
-		}
+		// The first frame goes out without waiting for the seek, the decoder starts catching up from the second
+		if (headPosition > 0 && framesToSkip > 0 && decodeFrame() == 0)
+			framesToSkip--;
 
-		// Set up the parameters for the output RGB frame
-		(*rgb_frame)->format = AV_PIX_FMT_RGB24;
-		(*rgb_frame)->width = frame->width;
-		(*rgb_frame)->height = frame->height;
+		VideoFrameDescription videoFrameDescription = head[headPosition];
+		videoFrameDescription.frame = av_frame_clone(head[headPosition].frame);
+		videoFrameDescription.time += loopOffset;
+		tagLoopFrame(&videoFrameDescription, head[headPosition].time, head[headPosition].duration);
+		headPosition++;
 
-		// Allocate buffer for the RGB frame
-		int ret = av_frame_get_buffer(*rgb_frame, 32); // align to 32 bytes
-		if (ret < 0)
-		{
-			fprintf(stderr, "Could not allocate buffer for RGB frame\n");
-			av_frame_free(rgb_frame);
-			return ret;
-		}
+		lastTime = videoFrameDescription.time;
+		lastDuration = videoFrameDescription.duration;
 
-		// Initialize SWS context for software scaling
-		struct SwsContext *sws_ctx = sws_getContext(
-			frame->width, frame->height, (enum AVPixelFormat)frame->format,
-			frame->width, frame->height, AV_PIX_FMT_RGB24,
-			SWS_BILINEAR, NULL, NULL, NULL);
+		if (videoFrameDescription.frame == nullptr)
+			videoFrameDescription.ready = false;
 
-		if (sws_ctx == NULL)
-		{
-			fprintf(stderr, "Could not initialize sws context\n");
-			av_frame_free(rgb_frame);
-			return -1;
-		}
+		return videoFrameDescription;
+	}
+
+	/**
+	 * @brief Serve the next frame of a loop the viewer holds, which only tells it which frame to show
+	 *
+	 * @return VideoFrameDescription Frame description without data
+	 */
+	VideoFrameDescription nextResidentFrame()
+	{
+		const LoopFrame &loopFrame = loopFrames[passFrame];
 
-		// create an array of new linesizes
-		(*rgb_frame)->linesize[0] = frame->width * 3;
+		VideoFrameDescription videoFrameDescription;
+		videoFrameDescription.data = nullptr;
+		videoFrameDescription.width = 0;
+		videoFrameDescription.height = 0;
+		videoFrameDescription.stride = 0;
+		videoFrameDescription.ready = true;
+		videoFrameDescription.time = loopFrame.time + loopOffset;
+		videoFrameDescription.duration = loopFrame.duration;
+		videoFrameDescription.loopClip = loopClip;
+		videoFrameDescription.loopFrame = passFrame;
+		videoFrameDescription.loopLength = loopLength;
 
-		// Convert the image from its native format to RGB
-		ret = sws_scale(sws_ctx, (uint8_t const *const *)frame->data,
-						frame->linesize, 0, frame->height,
-						(*rgb_frame)->data, (*rgb_frame)->linesize);
+		for (int j = 0; j < 3 * 5; j++)
+			videoFrameDescription.colors[j] = loopFrame.colors[j];
 
-		if (ret <= 0)
-		{
-			fprintf(stderr, "Error while converting to RGB\n");
-			av_frame_free(rgb_frame);
-			sws_freeContext(sws_ctx);
-			return -1;
-		}
+		passFrame++;
 
-		// Free the SWS context
-		sws_freeContext(sws_ctx);
+		lastTime = videoFrameDescription.time;
+		lastDuration = videoFrameDescription.duration;
 
-		return 0;
+		return videoFrameDescription;
 	}
 
-	AVFormatContext *format;			/**< Format context */
-	AVCodecParameters *codecParameters; /**< Codec parameters */
-	const AVCodec *codec;				/**< Codec */
-	AVCodecContext *context;			/**< Codec context */
-	AVCodecParserContext *parser;		/**< Parser context */
-	AVPacket *packet;					/**< Packet */
-	AVFrame *frame;						/**< Frame */
-	AVFrame *rgb_frame;					/**< RGB frame */
-	uint8_t *data;						/**< Data */
-	int videoStreamIndex;				/**< Video stream index */
-	int status;							/**< Status */
+	/**
+	 * @brief Number the next frame of a pass for the viewer, and note its time and colors while the length of a pass is unknown
+	 *
+	 * @param vfd Frame description to number, or nullptr for a frame that was dropped
+	 * @param time Time of the frame within the clip in microseconds
+	 * @param duration Duration of the frame in microseconds
+	 */
+	void tagLoopFrame(VideoFrameDescription *vfd, int64_t time, int64_t duration)
+	{
+		if (passFrame < 0 || loopLength < 0 || (loopLength > 0 && passFrame >= loopLength))
+			return;
+
+		if (loopLength == 0 && passFrame == (int)loopFrames.size())
+		{
+			if (loopFrames.size() >= maxLoopFrames)
+			{
+				loopLength = -1;
+				loopFrames.clear();
+				return;
+			}
 
-	int64_t lastFrameTime = 0; /**< Last frame time */
-	int64_t frameDuration = 0; /**< Frame duration */
+			LoopFrame loopFrame;
+			loopFrame.time = time;
+			loopFrame.duration = duration;
 
-	// For the palettegen filter
-	AVFilterGraph *filterGraph;							   /**< Filter graph for the palettegen filter */
-	AVFilterContext *bufferSrcContext, *bufferSinkContext; /**< Buffer source and sink contexts */
-	const AVFilter *bufferSrc, *bufferSink;				   /**< Buffer source and sink */
-	AVFrame *paletteFrame;								   /**< Palette frame */
-	AVFilterInOut *outputs, *inputs;					   /**< Filter in/out */
+			for (int j = 0; j < 3 * 5; j++)
+				loopFrame.colors[j] = j < colors.size() ? colors[j] : 0.0f;
+
+			loopFrames.push_back(loopFrame);
+		}
+
+		if (vfd != nullptr)
+		{
+			vfd->loopClip = loopClip;
+			vfd->loopFrame = passFrame;
+			vfd->loopLength = loopLength > 0 ? loopLength : estimatedLength;
+		}
+
+		passFrame++;
+	}
 
-public:
 	/**
-	 * @brief Construct a new VideoLoader object
+	 * @brief Learn the length of a pass when the first full pass from the start ends
 	 *
 	 */
-	VideoLoader()
+	void endPass()
 	{
-		av_log_set_level(AV_LOG_QUIET);
-		print("VIDEO", "FFmpeg version: " + std::string(av_version_info()));
+		if (loopLength != 0 || passFrame <= 0 || passFrame != (int)loopFrames.size())
+			return;
+
+		loopLength = passFrame;
+
+		// The viewer collected frames for a loop of the estimated length, so it has to start over under a new number
+		if (estimatedLength > 0 && estimatedLength != loopLength)
+			loopClip = newLoopClip();
 	}
 
 	/**
-	 * @brief Get the status of the video loader
+	 * @brief Get a number for a loop that no other load has used
 	 *
-	 * @return int Status
+	 * @return int The number
 	 */
-	int getStatus()
+	static int newLoopClip()
 	{
-		return status;
+		static std::atomic<int> counter{0};
+		return ++counter;
 	}
 
 	/**
-	 * @brief Rewind the video
+	 * @brief Configure the decoder for the current step of the quality ladder
 	 *
+	 * Frames are only discarded once the head is complete and the decoder has caught up with it, since the head has
+	 * to be an unbroken run of frames and catching up counts them.
 	 */
-	void rewind()
+	void applyQuality()
 	{
-		avcodec_flush_buffers(context);
-		av_seek_frame(format, videoStreamIndex, 0, AVSEEK_FLAG_BACKWARD);
+		if (context == nullptr)
+			return;
+
+		int level = ladder.getLevel();
+		bool counting = !headComplete || framesToSkip > 0;
+
+		context->skip_loop_filter = level >= QualitySkipLoopFilter ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+		context->skip_frame = level >= QualitySkipNonReference && !counting ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
+		// Discarded frames leave gaps in the pass, so its frames cannot be numbered
+		if (context->skip_frame != AVDISCARD_DEFAULT)
+			passFrame = -1;
 	}
 
 	/**
-	 * @brief Extract colors from a frame
+	 * @brief Reopen the decoder at the resolution the current step of the quality ladder asks for
 	 *
-	 * @param frame Frame to extract colors from
-	 * @return std::vector<float> Colors extracted from the frame
+	 * A new decoder has to start at a keyframe, so this is only done where decoding restarts, on a rewind or seek.
 	 */
-	std::vector<float> extractColors(AVFrame *frame)
+	void applyLowres()
 	{
-		if (av_buffersrc_add_frame(bufferSrcContext, frame) < 0)
-		{
-			error("VIDEO", "Could not add frame to buffer source");
-			return std::vector<float>();
-		}
-		av_buffersrc_add_frame_flags(bufferSrcContext, nullptr, 0);
+		if (context == nullptr)
+			return;
 
-		paletteFrame = av_frame_alloc();
-		if (!paletteFrame)
-		{
-			error("VIDEO", "Could not allocate palette frame");
-			return std::vector<float>();
-		}
+		int lowres = ladder.getLevel() >= QualityLowRes ? std::min(1, (int)codec->max_lowres) : 0;
 
-		int ret = av_buffersink_get_frame(bufferSinkContext, paletteFrame);
-		if (ret == AVERROR(EAGAIN))
-		{
-			error("VIDEO", "Could not retrieve palette frame from buffer sink");
-			return std::vector<float>();
-		}
+		if (lowres == context->lowres)
+			return;
 
-		std::vector<float> colors;
-		uint32_t *palette = (uint32_t *)paletteFrame->data[0];
+		AVCodecContext *reopened = DecoderPool::get().acquire(codecParameters, decoderThreads, decoderThreadType, lowres);
 
-		int nColors = 5;
+		// Without a free decoder the video stays at the resolution it has
+		if (reopened == nullptr)
+			return;
 
-		for (int i = 0; i < nColors; i++)
-		{
-			uint32_t color = palette[i];
-			uint8_t r = (color >> 16) & 0xFF;
-			uint8_t g = (color >> 8) & 0xFF;
-			uint8_t b = color & 0xFF;
+		DecoderPool::get().release(context);
+		context = reopened;
+	}
 
-			colors.push_back(r / 255.0f);
-			colors.push_back(g / 255.0f);
-			colors.push_back(b / 255.0f);
-		}
+	/**
+	 * @brief Work out the presentation time of a decoded frame, which becomes lastTime
+	 *
+	 * @param decoded Decoded frame
+	 * @return int64_t Duration of the frame in microseconds
+	 */
+	int64_t timeFrame(AVFrame *decoded)
+	{
+		AVRational timeBase = format->streams[videoStreamIndex]->time_base;
+		int64_t duration = decoded->duration > 0 ? av_rescale_q(decoded->duration, timeBase, AV_TIME_BASE_Q) : getFrameDuration();
 
-		return colors;
+		// Frames without a timestamp follow on from the previous frame
+		if (decoded->best_effort_timestamp != AV_NOPTS_VALUE)
+			clipTime = av_rescale_q(decoded->best_effort_timestamp, timeBase, AV_TIME_BASE_Q) - startTime;
+		else
+			clipTime += lastDuration;
+
+		lastTime = clipTime + loopOffset;
+		lastDuration = duration;
+
+		return duration;
 	}
 
 	/**
-	 * @brief Check if the next frame should be retrieved
+	 * @brief Get the number of frames dropped for being late since the last call, and reset it
 	 *
-	 * @param currentTime Current time
-	 * @return bool Whether the next frame should be retrieved
+	 * @return int Number of dropped frames
 	 */
-	bool shouldGetNextFrame(int64_t currentTime)
+	int takeDroppedFrames()
 	{
-		if (frameDuration == 0)
-		{
-			frameDuration = float(format->streams[videoStreamIndex]->r_frame_rate.den) / float(format->streams[videoStreamIndex]->r_frame_rate.num) * 1000000.0f;
-		}
+		int dropped = droppedFrames;
+		droppedFrames = 0;
 
-		if (
-			currentTime >= lastFrameTime + frameDuration ||
-			currentTime + 1000000 / 120 >= lastFrameTime + frameDuration)
-		{
-			lastFrameTime = currentTime;
-			return true;
-		}
-		return false;
+		return dropped;
+	}
+
+	/**
+	 * @brief Set the colors to the precomputed palette at the timestamp of a decoded frame
+	 *
+	 * @param decoded Decoded frame
+	 */
+	void updateColorsFromTimeline(AVFrame *decoded)
+	{
+		if (decoded->best_effort_timestamp == AV_NOPTS_VALUE)
+			return;
+
+		int64_t time = av_rescale_q(decoded->best_effort_timestamp, format->streams[videoStreamIndex]->time_base, AV_TIME_BASE_Q);
+
+		auto next = std::upper_bound(timeline.begin(), timeline.end(), time, [](int64_t t, const PaletteKeyframe &keyframe)
+									 { return t < keyframe.time; });
+
+		colors = next == timeline.begin() ? next->colors : (next - 1)->colors;
 	}
 
 	/**
 	 * @brief Get the next frame from the video
 	 *
+	 * @param dropBefore Presentation time before which decoded frames are late and dropped without being converted
 	 * @return VideoFrameDescription Frame description
 	 */
-	VideoFrameDescription getFrame()
+	VideoFrameDescription getFrame(int64_t dropBefore = INT64_MIN)
 	{
-		if (usedFrame)
+		if (hasWarmFrame)
+		{
+			hasWarmFrame = false;
+			return warmFrame;
+		}
+
+		// The viewer dropped the loop, so the decoder picks up where the pass is
+		if (resident && residentLoop != loopClip && passFrame < loopLength)
+		{
+			resident = false;
+			seek(loopFrames[passFrame].time);
+		}
+
+		// Passes that are not decoded only end here
+		if (resident ? passFrame >= loopLength : wholeClip && headPosition >= head.size())
 		{
-			getReadyForNextFrame();
+			endPass();
+			rewind();
 		}
 
-		usedFrame = true;
-		int data_size = 0;
-		bool got_frame = false;
+		if (resident)
+			return nextResidentFrame();
+
+		if (headPosition < head.size())
+			return nextHeadFrame();
 
 		VideoFrameDescription videoFrameDescription;
 		videoFrameDescription.ready = false;
 
+		applyQuality();
+
+		auto decodeStart = std::chrono::steady_clock::now();
+		int64_t covered = 0;
+		bool rewound = false;
+
 		while (true)
 		{
-			if (av_read_frame(format, packet) < 0)
+			int ret = decodeFrame();
+
+			if (ret < 0)
 			{
-				// End of video, seek to start
-				rewind();
-				continue;
+				// Frames after an error cannot be numbered within the pass
+				passFrame = -1;
+				return videoFrameDescription;
 			}
 
-			if (packet->stream_index == videoStreamIndex)
+			if (ret == 1)
 			{
-				data = packet->data;
-				data_size = packet->size;
+				// A pass without a single frame would be looped forever
+				if (rewound)
+				{
+					passFrame = -1;
+					return videoFrameDescription;
+				}
 
-				while (data_size > 0)
+				// End of video, loop back to the start, which the cached head covers
+				if (!headComplete)
 				{
-					int ret = av_parser_parse2(parser, context, &packet->data, &packet->size, data, data_size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
-
-					if (ret < 0)
-					{
-						error("VIDEO", "Error while parsing");
-						return videoFrameDescription;
-					}
-
-					data += ret;
-					data_size -= ret;
-
-					if (packet->size)
-					{
-						ret = avcodec_send_packet(context, packet);
-
-						if (ret < 0)
-						{
-							error("VIDEO", "Error while sending packet");
-							return videoFrameDescription;
-						}
-
-						while (ret >= 0)
-						{
-							ret = avcodec_receive_frame(context, frame);
-
-							if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-							{
-								break;
-							}
-							else if (ret < 0)
-							{
-								error("VIDEO", "Error while receiving frame");
-								return videoFrameDescription;
-							}
-
-							if (convertToRGB(frame, &rgb_frame) < 0)
-							{
-								error("VIDEO", "Could not convert frame to RGB");
-								return videoFrameDescription;
-							}
-
-							if (colors.size() == 0)
-								colors = extractColors(rgb_frame);
-
-							videoFrameDescription.width = rgb_frame->width;
-							videoFrameDescription.height = rgb_frame->height;
-							videoFrameDescription.data = rgb_frame->data[0];
-
-							got_frame = true;
-							break;
-						}
-					}
-
-					if (got_frame)
-						break;
+					wholeClip = head.size() > 0;
+					headComplete = true;
 				}
+
+				endPass();
+				rewind();
+				rewound = true;
+
+				if (resident)
+					return nextResidentFrame();
+
+				if (headPosition < head.size())
+					return nextHeadFrame();
+
+				continue;
 			}
 
-			if (got_frame)
+			rewound = false;
+
+			// Frames that are already in the head were served from the cache, so the decoder only has to catch up
+			if (framesToSkip > 0)
 			{
-				videoFrameDescription.ready = true;
-				break;
+				framesToSkip--;
+				continue;
+			}
+
+			int64_t duration = timeFrame(frame);
+
+			// Frames between the keyframe and the target of a seek only have to be decoded
+			if (clipTime + duration <= seekTarget)
+				continue;
+
+			seekTarget = INT64_MIN;
+			covered += duration;
+
+			// At half frame rate every other frame is only decoded, for the frames that refer to it
+			bool halfRate = headComplete && ladder.getLevel() >= QualityHalfRate;
+
+			if (halfRate)
+				halfRateSkip = !halfRateSkip;
+
+			if (halfRate && halfRateSkip)
+			{
+				tagLoopFrame(nullptr, clipTime, duration);
+				continue;
+			}
+
+			// Late frames are dropped before conversion, but never while the head is being filled
+			if (headComplete && lastTime + duration < dropBefore && droppedInARow < maxDropsInARow)
+			{
+				tagLoopFrame(nullptr, clipTime, duration);
+				droppedFrames++;
+				droppedInARow++;
+				continue;
+			}
+
+			droppedInARow = 0;
+			break;
+		}
+
+		// Unpacked blocks go to the viewer as they are
+		int converted = blockFormat >= 0 ? ((displayFrame = av_frame_clone(frame)) != nullptr ? 0 : -1) : converter.convert(frame, &displayFrame);
+
+		if (converted < 0)
+		{
+			error("VIDEO", "Could not convert frame");
+			tagLoopFrame(nullptr, clipTime, lastDuration);
+
+			// The head has to be an unbroken run of frames from the start
+			headComplete = true;
+			return videoFrameDescription;
+		}
+
+		if (blockFormat >= 0)
+			describeBlocks(displayFrame, videoFrameDescription);
+		else
+			FrameConverter::describe(displayFrame, codecParameters->height, videoFrameDescription);
+
+		if (timeline.size() > 0)
+		{
+			updateColorsFromTimeline(frame);
+		}
+		else if (colors.size() == 0)
+		{
+			colors = PaletteExtractor::extract(videoFrameDescription);
+
+			if (colors.size() > 0)
+				PaletteCache::store(path, colors);
+		}
+
+		for (int j = 0; j < 3 * 5; j++)
+			videoFrameDescription.colors[j] = j < colors.size() ? colors[j] : 0.0f;
+
+		videoFrameDescription.time = lastTime;
+		videoFrameDescription.duration = lastDuration;
+		videoFrameDescription.ready = true;
+		tagLoopFrame(&videoFrameDescription, clipTime, lastDuration);
+
+		if (!headComplete)
+		{
+			// Head frames are stored with their time within the clip, and offset again whenever they are served
+			VideoFrameDescription cached = videoFrameDescription;
+			cached.time = clipTime;
+			cached.frame = av_frame_clone(displayFrame);
+
+			if (cached.frame != nullptr)
+			{
+				head.push_back(cached);
+				headPosition = head.size();
 			}
+
+			headComplete = cached.frame == nullptr || head.size() >= headLength;
 		}
 
+		int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - decodeStart).count();
+
+		if (ladder.measure(elapsed, covered))
+		{
+			print("VIDEO", std::string("Quality: ") + QualityLadder::getName(ladder.getLevel()));
+			applyQuality();
+		}
+
+		// Hand ownership of the converted frame to the caller, who releases it once it has been displayed
+		videoFrameDescription.frame = displayFrame;
+		displayFrame = nullptr;
+
 		return videoFrameDescription;
 	}
 
+	/**
+	 * @brief Describe a frame of unpacked blocks
+	 *
+	 * @param blocks Frame holding the blocks
+	 * @param vfd Frame description to fill in
+	 */
+	void describeBlocks(AVFrame *blocks, VideoFrameDescription &vfd)
+	{
+		vfd.width = blocks->width;
+		vfd.height = blocks->height;
+		vfd.data = blocks->data[0];
+		vfd.stride = blocks->linesize[0];
+		vfd.format = blockFormat;
+		vfd.bt709 = false;
+		vfd.fullRange = true;
+	}
+
 	/**
 	 * @brief Get the colors extracted from the video
 	 *
@@ -369,16 +1200,46 @@ public:
 		}
 
 		used = true;
+		status = 0;
+		path = videoPath;
 		format = avformat_alloc_context();
+		format->interrupt_callback.callback = &VideoLoader::interrupt;
+		format->interrupt_callback.opaque = this;
+
+		if (memoryMapped)
+		{
+			AVIOContext *io = mappedFile.open(videoPath) == 0 ? mappedFile.createContext() : nullptr;
+
+			// Without a mapping, FFmpeg simply opens the file itself
+			if (io != nullptr)
+			{
+				format->pb = io;
+				format->flags |= AVFMT_FLAG_CUSTOM_IO;
+			}
+			else
+			{
+				warn("VIDEO", "Could not map " + videoPath + ", reading it normally");
+				mappedFile.close();
+			}
+		}
+
 		if (avformat_open_input(&format, videoPath.c_str(), nullptr, nullptr) < 0)
 		{
-			error("VIDEO", "Could not open video file");
+			if (interrupt(this))
+				print("VIDEO", "Cancelled loading " + videoPath);
+			else
+				error("VIDEO", "Could not open video file");
+
 			return -1;
 		}
 
 		if (avformat_find_stream_info(format, nullptr) < 0)
 		{
-			error("VIDEO", "Could not find video stream info");
+			if (interrupt(this))
+				print("VIDEO", "Cancelled loading " + videoPath);
+			else
+				error("VIDEO", "Could not find video stream info");
+
 			return -1;
 		}
 
@@ -398,34 +1259,43 @@ public:
 			return -1;
 		}
 
-		codecParameters = format->streams[videoStreamIndex]->codecpar;
-		codec = avcodec_find_decoder(codecParameters->codec_id);
-		if (!codec)
-		{
-			error("VIDEO", "Codec not found");
-			return -1;
-		}
+		// Audio and data streams are skipped by the demuxer, instead of being read only to be thrown away
+		for (unsigned int i = 0; i < format->nb_streams; i++)
+			format->streams[i]->discard = (int)i == videoStreamIndex ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
 
-		context = avcodec_alloc_context3(codec);
-		if (avcodec_parameters_to_context(context, codecParameters) < 0)
-		{
-			error("VIDEO", "Could not copy codec parameters to context");
-			return -1;
-		}
+		AVStream *stream = format->streams[videoStreamIndex];
+		startTime = stream->start_time != AV_NOPTS_VALUE ? av_rescale_q(stream->start_time, stream->time_base, AV_TIME_BASE_Q) : 0;
 
-		if (avcodec_open2(context, codec, nullptr) < 0)
+		// Containers without an index of their own are scanned in the background, so that no seek has to wait for it
+		if (!keyframes.load(path, stream))
+			KeyframeScanner::get().request(path);
+
+		loopClip = newLoopClip();
+		estimatedLength = stream->nb_frames > 0 && stream->nb_frames <= maxLoopFrames ? (int)stream->nb_frames : 0;
+
+		codecParameters = stream->codecpar;
+		blockFormat = codecParameters->codec_id == AV_CODEC_ID_HAP ? probeBlockFormat() : -1;
+
+		if (blockFormat >= 0)
 		{
-			error("VIDEO", "Could not open codec");
-			return -1;
-		}
+			blockPool = av_buffer_pool_init(HapUnpacker::getSize(blockFormat, codecParameters->width, codecParameters->height), nullptr);
 
-		parser = av_parser_init(codec->id);
-		if (!parser)
+			if (!blockPool)
+			{
+				error("VIDEO", "Could not allocate block pool");
+				return -1;
+			}
+		}
+		else if (openDecoder() < 0)
 		{
-			error("VIDEO", "Parser not found");
 			return -1;
 		}
 
+		// Unpacked blocks have no decoder to make cheaper, they can only be shown less often
+		ladder.setAvailable(QualitySkipLoopFilter, blockFormat < 0);
+		ladder.setAvailable(QualitySkipNonReference, blockFormat < 0);
+		ladder.setAvailable(QualityLowRes, blockFormat < 0 && codec->max_lowres > 0);
+
 		packet = av_packet_alloc();
 		if (!packet)
 		{
@@ -433,6 +1303,13 @@ public:
 			return -1;
 		}
 
+		// A clip that was looped before is replayed from memory right away, the file is only read for its headers
+		cachedPackets = PacketCache::get().find(path);
+		recordPackets = cachedPackets == nullptr;
+
+		if (recordPackets)
+			startRecording();
+
 		frame = av_frame_alloc();
 		if (!frame)
 		{
@@ -440,84 +1317,72 @@ public:
 			return -1;
 		}
 
-		filterGraph = avfilter_graph_alloc();
-		if (!filterGraph)
-		{
-			error("VIDEO", "Could not allocate filter graph");
-			return -1;
-		}
-
-		bufferSrc = avfilter_get_by_name("buffer");
-		bufferSink = avfilter_get_by_name("buffersink");
-		if (!bufferSrc || !bufferSink)
-		{
-			error("VIDEO", "Could not get filter");
-			return -1;
-		}
+		// On a hit the palette is never extracted for this video
+		if (PaletteCache::loadTimeline(path, timeline))
+			colors = timeline[0].colors;
+		else
+			PaletteCache::load(path, colors);
 
-		outputs = avfilter_inout_alloc();
-		inputs = avfilter_inout_alloc();
-		if (!outputs || !inputs)
-		{
-			error("VIDEO", "Could not allocate filter in/out");
-			return -1;
-		}
+		status = 1;
 
-		char args[512];
-		snprintf(args, sizeof(args),
-				 "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-				 context->width, context->height, AV_PIX_FMT_RGB24,
-				 format->streams[videoStreamIndex]->time_base.num, format->streams[videoStreamIndex]->time_base.den,
-				 context->sample_aspect_ratio.num, context->sample_aspect_ratio.den);
+		return 0;
+	}
 
-		if (avfilter_graph_create_filter(&bufferSrcContext, bufferSrc, "in", args, nullptr, filterGraph) < 0)
-		{
-			error("VIDEO", "Could not create filter");
-			return -1;
-		}
-		if (avfilter_graph_create_filter(&bufferSinkContext, bufferSink, "out", nullptr, nullptr, filterGraph) < 0)
-		{
-			error("VIDEO", "Could not create filter");
-			return -1;
-		}
-		if (!bufferSrcContext || !bufferSinkContext)
+	/**
+	 * @brief Open the decoder of the video stream
+	 *
+	 * @return int 0 if successful, -1 otherwise
+	 */
+	int openDecoder()
+	{
+		codec = avcodec_find_decoder(codecParameters->codec_id);
+		if (!codec)
 		{
-			error("VIDEO", "Could not create filter");
+			error("VIDEO", "Codec not found");
 			return -1;
 		}
 
-		enum AVPixelFormat pix_fmts[] = {AV_PIX_FMT_RGB32, AV_PIX_FMT_NONE};
-		int ret = av_opt_set_int_list(bufferSinkContext, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+		int threads = budgeted ? DecoderThreadBudget::get().acquire(requestedThreads) : DecoderThreadBudget::get().share(requestedThreads);
+		int threadType = lowLatency ? FF_THREAD_SLICE : FF_THREAD_FRAME | FF_THREAD_SLICE;
 
-		if (ret < 0)
-		{
-			error("VIDEO", "Could not set pixel formats");
-			return -1;
-		}
+		if (budgeted)
+			grantedThreads = threads;
 
-		outputs->name = av_strdup("in");
-		outputs->filter_ctx = bufferSrcContext;
-		outputs->pad_idx = 0;
-		outputs->next = nullptr;
+		decoderThreads = threads;
+		decoderThreadType = threadType;
 
-		inputs->name = av_strdup("out");
-		inputs->filter_ctx = bufferSinkContext;
-		inputs->pad_idx = 0;
-		inputs->next = nullptr;
+		// Conversion runs between decodes, so it can use the layer's share of threads as well
+		converter.setThreads(threads);
 
-		if (avfilter_graph_parse_ptr(filterGraph, "palettegen=max_colors=5", &inputs, &outputs, nullptr) < 0)
+		context = DecoderPool::get().acquire(codecParameters, threads, threadType);
+		if (!context)
 		{
-			error("VIDEO", "Could not parse filter graph");
+			error("VIDEO", "Could not open codec, or too many decoders are open");
 			return -1;
 		}
 
-		if (avfilter_graph_config(filterGraph, nullptr) < 0)
+		// A pooled decoder may have been opened with fewer threads than the layer's share, the rest go back to the budget
+		if (context->thread_count > 0 && context->thread_count < threads)
 		{
-			error("VIDEO", "Could not configure filter graph");
-			return -1;
+			if (budgeted)
+			{
+				DecoderThreadBudget::get().release(threads - context->thread_count);
+				grantedThreads = context->thread_count;
+			}
+
+			decoderThreads = context->thread_count;
 		}
 
-		status = 1;
+		// Only raw elementary streams come without frame boundaries and timestamps, and need to be parsed
+		if (format->iformat->flags & AVFMT_NOTIMESTAMPS)
+		{
+			parser = av_parser_init(codec->id);
+			if (!parser)
+			{
+				error("VIDEO", "Parser not found");
+				return -1;
+			}
+		}
 
 		return 0;
 	}
@@ -529,29 +1394,67 @@ public:
 	void getReadyForNextLoad()
 	{
 		av_parser_close(parser);
-		avcodec_free_context(&context);
+		parser = nullptr;
+
+		// The decoder goes back to the pool, where the next clip with the same parameters can pick it up
+		DecoderPool::get().release(context);
+		context = nullptr;
+
+		DecoderThreadBudget::get().release(grantedThreads);
+		grantedThreads = 0;
+
 		av_frame_free(&frame);
 		av_packet_free(&packet);
 		avformat_close_input(&format);
+		mappedFile.close();
 
-		av_frame_free(&rgb_frame);
-		av_frame_free(&paletteFrame);
-		avfilter_graph_free(&filterGraph);
-		avfilter_inout_free(&inputs);
-		avfilter_inout_free(&outputs);
+		// Blocks that are still on their way to the viewer keep the pool alive until they are released
+		av_buffer_pool_uninit(&blockPool);
+		blockFormat = -1;
 
-		colors.clear();
-	}
+		if (hasWarmFrame)
+		{
+			av_frame_free(&warmFrame.frame);
+			hasWarmFrame = false;
+		}
 
-	/**
-	 * @brief Free resources and get ready for the next frame
-	 *
-	 */
-	void getReadyForNextFrame()
-	{
-		av_frame_unref(frame);
-		av_frame_unref(rgb_frame);
-		av_packet_unref(packet);
-		av_frame_unref(paletteFrame);
+		av_frame_free(&displayFrame);
+
+		for (VideoFrameDescription &cached : head)
+			av_frame_free(&cached.frame);
+
+		head.clear();
+		headPosition = 0;
+		headComplete = false;
+		wholeClip = false;
+		framesToSkip = 0;
+
+		clipTime = 0;
+		loopOffset = 0;
+		lastTime = 0;
+		lastDuration = 0;
+		droppedInARow = 0;
+
+		keyframes.clear();
+		seekTarget = INT64_MIN;
+
+		loopClip = 0;
+		loopLength = 0;
+		estimatedLength = 0;
+		passFrame = 0;
+		loopFrames.clear();
+		residentLoop = 0;
+		resident = false;
+
+		ladder.reset();
+		halfRateSkip = false;
+
+		cachedPackets.reset();
+		replayPosition = 0;
+		recordPackets = false;
+		stopRecording();
+
+		colors.clear();
+		timeline.clear();
 	}
 };
@@ -0,0 +1,529 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "VideoLoader.cpp"
+#include "VideoFrameDescription.h"
+#include "FrameQueue.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Runs a VideoLoader on its own decode thread and buffers decoded frames for the UI thread
+ *
+ * The UI thread only posts requests (load, rewind) and pops frames. All FFmpeg work happens on the decode thread, which
+ * keeps the frame queue topped up. Every request bumps a generation counter, so frames decoded before a request are
+ * recognized and dropped by the consumer instead of the producer having to clear the queue.
+ *
+ * Frames are presented by their timestamps. The first frame of each generation anchors the stream's timeline to the
+ * show clock, after which the latest frame that is due is shown and any earlier ones are dropped. The resulting
+ * playhead is shared with the decode thread, so that frames that are already late are dropped before conversion.
+ */
+class VideoPlayer
+{
+public:
+	/**
+	 * @brief Construct a new VideoPlayer object and start its decode thread
+	 *
+	 * @param queueSize Number of decoded frames to buffer ahead
+	 */
+	VideoPlayer(size_t queueSize = 4)
+		: loader(new VideoLoader()), queue(queueSize)
+	{
+		loader->setInterrupt(&interruptLoad);
+
+		running = true;
+		thread = std::thread(&VideoPlayer::run, this);
+	}
+
+	~VideoPlayer()
+	{
+		stop();
+	}
+
+	/**
+	 * @brief Stop the decode thread and release all buffered frames
+	 *
+	 */
+	void stop()
+	{
+		running = false;
+
+		if (thread.joinable())
+			thread.join();
+
+		VideoFrameDescription vfd;
+		while (queue.pop(vfd))
+			releaseFrame(vfd);
+
+		delete requestedLoader;
+		requestedLoader = nullptr;
+
+		delete loader;
+		loader = nullptr;
+	}
+
+	/**
+	 * @brief Request a video to be loaded on the decode thread
+	 *
+	 * @param videoPath Path to the video
+	 */
+	void load(const std::string &videoPath)
+	{
+		std::lock_guard<std::mutex> lock(requestMutex);
+
+		delete requestedLoader;
+		requestedLoader = nullptr;
+
+		requestedPath = videoPath;
+		requestedUnload = false;
+		requestedSeek = -1;
+		status = 0;
+		loading = true;
+		interruptLoad = true;
+		generation++;
+	}
+
+	/**
+	 * @brief Request a loader that has already been opened, for example by the prefetcher, to replace the current one
+	 *
+	 * The previous loader is freed on the decode thread. The adopted loader keeps the threading it was opened with.
+	 *
+	 * @param videoLoader The loader to adopt, owned by the player from now on
+	 */
+	void adopt(VideoLoader *videoLoader)
+	{
+		std::lock_guard<std::mutex> lock(requestMutex);
+
+		delete requestedLoader;
+		requestedLoader = videoLoader;
+		requestedLoader->setInterrupt(&interruptLoad);
+
+		requestedPath.clear();
+		requestedUnload = false;
+		requestedSeek = -1;
+		status = 0;
+		loading = true;
+		interruptLoad = true;
+		generation++;
+	}
+
+	/**
+	 * @brief Request the current video to be closed on the decode thread, returning its decoder to the pool
+	 *
+	 */
+	void unload()
+	{
+		std::lock_guard<std::mutex> lock(requestMutex);
+
+		delete requestedLoader;
+		requestedLoader = nullptr;
+
+		requestedPath.clear();
+		requestedUnload = true;
+		requestedSeek = -1;
+		status = 0;
+		loading = false;
+		interruptLoad = true;
+		generation++;
+	}
+
+	/**
+	 * @brief Request the video to be rewound on the decode thread
+	 *
+	 */
+	void rewind()
+	{
+		std::lock_guard<std::mutex> lock(requestMutex);
+
+		requestedRewind = true;
+		requestedSeek = -1;
+		generation++;
+	}
+
+	/**
+	 * @brief Request the video to seek to a time on the decode thread
+	 *
+	 * A seek right after a load or adopt is applied once the video is open, which makes it a start offset.
+	 *
+	 * @param time Time within the clip in microseconds
+	 */
+	void seek(int64_t time)
+	{
+		std::lock_guard<std::mutex> lock(requestMutex);
+
+		requestedRewind = false;
+		requestedSeek = std::max((int64_t)0, time);
+		generation++;
+	}
+
+	/**
+	 * @brief Configure decoder threading, applied when the next video is loaded
+	 *
+	 * @param threads Number of decoder threads, 0 for a fair share of the global budget
+	 * @param sliceOnly Whether to use slice threading only, avoiding the frame delay of frame threading
+	 */
+	void setThreading(int threads, bool sliceOnly)
+	{
+		decoderThreads = threads;
+		decoderSliceOnly = sliceOnly;
+	}
+
+	/**
+	 * @brief Set whether videos are read through a memory mapping, applied when the next video is loaded
+	 *
+	 * @param memoryMapped Whether to map videos into memory
+	 */
+	void setMemoryMapped(bool memoryMapped)
+	{
+		this->memoryMapped = memoryMapped;
+	}
+
+	/**
+	 * @brief Set the resolution decoded frames are scaled down to
+	 *
+	 * @param width Target width, 0 for the source width
+	 * @param height Target height, 0 for the source height
+	 */
+	void setTargetSize(int width, int height)
+	{
+		targetWidth = width;
+		targetHeight = height;
+	}
+
+	/**
+	 * @brief Tell the player which loop the viewer holds every frame of, so that it is played without decoding
+	 *
+	 * @param loop The loop, as numbered in the frames, or 0 for none
+	 */
+	void setResidentLoop(int loop)
+	{
+		residentLoop = loop;
+	}
+
+	/**
+	 * @brief Set whether decoding gets cheaper automatically when it cannot keep up
+	 *
+	 * @param adaptive Whether to step down the quality ladder under load
+	 */
+	void setAdaptiveQuality(bool adaptive)
+	{
+		adaptiveQuality = adaptive;
+	}
+
+	/**
+	 * @brief Get the step of the quality ladder the current video is decoded at
+	 *
+	 * @return int The step, see QualityLevel
+	 */
+	int getQuality()
+	{
+		return quality;
+	}
+
+	/**
+	 * @brief Get the status of the player
+	 *
+	 * @return int 1 if a video is loaded, 0 otherwise
+	 */
+	int getStatus()
+	{
+		return status;
+	}
+
+	/**
+	 * @brief Get the next frame, if it is time for it and one has been decoded
+	 *
+	 * @param currentTime Current time in microseconds
+	 * @param vfd The frame, which must be passed to releaseFrame once it has been used
+	 * @return true If a frame was retrieved
+	 * @return false If no frame is due or available
+	 */
+	bool getFrame(int64_t currentTime, VideoFrameDescription &vfd)
+	{
+		dropStaleFrames();
+
+		VideoFrameDescription *next = queue.front();
+
+		if (next == nullptr)
+			return false;
+
+		if (next->generation != anchorGeneration)
+		{
+			anchorGeneration = next->generation;
+			anchorClock = currentTime;
+			anchorTime = next->time;
+		}
+
+		int64_t now = anchorTime + (currentTime - anchorClock);
+
+		playhead = now;
+		playheadGeneration = anchorGeneration;
+
+		// Show the latest frame that is due, allowing for a frame that becomes due before the next repaint
+		bool gotFrame = false;
+
+		while ((next = queue.front()) != nullptr && next->generation == anchorGeneration && next->time <= now + 1000000 / 120)
+		{
+			if (gotFrame)
+			{
+				releaseFrame(vfd);
+				droppedFrames++;
+			}
+
+			queue.pop(vfd);
+			gotFrame = true;
+		}
+
+		if (!gotFrame)
+			return false;
+
+		drift = 0.9f * drift + 0.1f * float(now - vfd.time) / 1000.0f;
+
+		colors.assign(vfd.colors, vfd.colors + 3 * 5);
+
+		return true;
+	}
+
+	/**
+	 * @brief Get how late frames are presented, averaged over recent frames
+	 *
+	 * @return float Drift in milliseconds, positive when frames are late
+	 */
+	float getDrift()
+	{
+		return drift;
+	}
+
+	/**
+	 * @brief Get the number of frames dropped for being late, by either the decode thread or the UI thread
+	 *
+	 * @return int Number of dropped frames since the last load
+	 */
+	int getDroppedFrames()
+	{
+		return droppedFrames;
+	}
+
+	/**
+	 * @brief Release a frame retrieved with getFrame
+	 *
+	 * @param vfd The frame to release
+	 */
+	void releaseFrame(VideoFrameDescription &vfd)
+	{
+		av_frame_free(&vfd.frame);
+		vfd.data = nullptr;
+	}
+
+	/**
+	 * @brief Check if a requested video is still being opened, which ends once its first frame is ready to be shown
+	 *
+	 * Loading happens on the decode thread, so the UI thread only has to poll this.
+	 *
+	 * @return true If the video is loading
+	 * @return false If its first frame is ready, or the load failed or was cancelled
+	 */
+	bool isLoading()
+	{
+		return loading;
+	}
+
+	/**
+	 * @brief Get the colors of the most recently retrieved frame
+	 *
+	 * @return std::vector<float> Colors extracted from the video
+	 */
+	std::vector<float> getColors()
+	{
+		return colors;
+	}
+
+private:
+	VideoLoader *loader;					/**< The loader, only touched by the decode thread */
+	FrameQueue<VideoFrameDescription> queue; /**< Decoded frames waiting to be displayed */
+	std::thread thread;						/**< The decode thread */
+	std::atomic<bool> running;				/**< Whether the decode thread should keep running */
+
+	std::mutex requestMutex;		   /**< Guards the pending requests */
+	std::string requestedPath;		   /**< Path of the pending load request, empty if none */
+	VideoLoader *requestedLoader = nullptr; /**< Loader of the pending adopt request, nullptr if none */
+	bool requestedRewind = false;	   /**< Whether a rewind is pending */
+	bool requestedUnload = false;	   /**< Whether an unload is pending */
+	int64_t requestedSeek = -1;		   /**< Time to seek to in microseconds, -1 if no seek is pending */
+	std::atomic<int> generation{0};	   /**< Incremented on every request */
+	std::atomic<int> status{0};		   /**< Status of the loader */
+	std::atomic<bool> loading{false};	   /**< Whether the requested video has no frame ready yet */
+	std::atomic<bool> interruptLoad{false}; /**< Set by every load, adopt and unload request, to cancel a load in progress */
+	std::atomic<int64_t> playhead{0};			   /**< Presentation time that is on screen now */
+	std::atomic<int> playheadGeneration{-1};	   /**< Generation the playhead belongs to */
+	std::atomic<int> droppedFrames{0};			   /**< Number of frames dropped for being late */
+	std::atomic<int> decoderThreads{0};	   /**< Number of decoder threads, 0 for a fair share */
+	std::atomic<bool> decoderSliceOnly{false}; /**< Whether to use slice threading only */
+	std::atomic<bool> memoryMapped{false};	   /**< Whether videos are read through a memory mapping */
+	std::atomic<int> targetWidth{0};		   /**< Width to scale frames down to, 0 for the source width */
+	std::atomic<int> targetHeight{0};		   /**< Height to scale frames down to, 0 for the source height */
+	std::atomic<int> residentLoop{0};		   /**< Loop the viewer holds every frame of, 0 for none */
+	std::atomic<bool> adaptiveQuality{true};   /**< Whether decoding gets cheaper when it cannot keep up */
+	std::atomic<int> quality{0};			   /**< Step of the quality ladder the loader decodes at */
+
+	int anchorGeneration = -1; /**< Generation the anchor belongs to, UI thread only */
+	int64_t anchorClock = 0;   /**< Show clock at the anchor in microseconds, UI thread only */
+	int64_t anchorTime = 0;	   /**< Presentation time of the frame at the anchor, UI thread only */
+	float drift = 0.0f;		   /**< Average lateness of presented frames in milliseconds, UI thread only */
+	std::vector<float> colors; /**< Colors of the last retrieved frame, UI thread only */
+
+	/**
+	 * @brief Drop frames that were decoded before the latest request
+	 *
+	 */
+	void dropStaleFrames()
+	{
+		VideoFrameDescription *next;
+
+		while ((next = queue.front()) != nullptr && next->generation != generation)
+		{
+			VideoFrameDescription vfd;
+			queue.pop(vfd);
+			releaseFrame(vfd);
+		}
+	}
+
+	/**
+	 * @brief Mark the requested video as no longer loading, unless a newer request has come in since
+	 *
+	 * @param loadGeneration Generation of the request that finished loading
+	 */
+	void finishLoading(int loadGeneration)
+	{
+		std::lock_guard<std::mutex> lock(requestMutex);
+
+		if (loadGeneration == generation)
+			loading = false;
+	}
+
+	/**
+	 * @brief Endlessly decode frames into the queue (should be run in a separate thread)
+	 *
+	 */
+	void run()
+	{
+		int currentGeneration = 0;
+
+		while (running)
+		{
+			std::string path;
+			VideoLoader *adopted = nullptr;
+			bool rewind = false;
+			bool unload = false;
+			int64_t seek = -1;
+
+			{
+				std::lock_guard<std::mutex> lock(requestMutex);
+
+				if (currentGeneration != generation)
+				{
+					currentGeneration = generation;
+					path.swap(requestedPath);
+					adopted = requestedLoader;
+					requestedLoader = nullptr;
+					rewind = requestedRewind;
+					requestedRewind = false;
+					unload = requestedUnload;
+					requestedUnload = false;
+					seek = requestedSeek;
+					requestedSeek = -1;
+					interruptLoad = false;
+				}
+			}
+
+			if (unload)
+			{
+				delete loader;
+				loader = new VideoLoader();
+				loader->setInterrupt(&interruptLoad);
+			}
+			else if (adopted != nullptr)
+			{
+				delete loader;
+				loader = adopted;
+				loader->claimThreads();
+
+				if (loader->getStatus() == 1)
+				{
+					droppedFrames = 0;
+					status = 1;
+				}
+				else
+				{
+					finishLoading(currentGeneration);
+				}
+			}
+			else if (!path.empty())
+			{
+				loader->setThreading(decoderThreads, decoderSliceOnly);
+				loader->setMemoryMapped(memoryMapped);
+
+				if (loader->loadVideo(path) == 0)
+				{
+					droppedFrames = 0;
+					status = 1;
+				}
+				else
+				{
+					finishLoading(currentGeneration);
+				}
+			}
+			else if (rewind && loader->getStatus() == 1)
+			{
+				loader->rewind();
+			}
+
+			if (seek >= 0 && loader->getStatus() == 1)
+				loader->seek(seek);
+
+			if (loader->getStatus() != 1 || status != 1 || queue.full())
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+
+			loader->setTargetSize(targetWidth, targetHeight);
+			loader->setResidentLoop(residentLoop);
+			loader->setAdaptiveQuality(adaptiveQuality);
+
+			// Until the UI thread has anchored this generation there is no playhead to be late for
+			int64_t dropBefore = playheadGeneration == currentGeneration ? (int64_t)playhead : INT64_MIN;
+
+			VideoFrameDescription vfd = loader->getFrame(dropBefore);
+			vfd.generation = currentGeneration;
+			droppedFrames += loader->takeDroppedFrames();
+			quality = loader->getQuality();
+
+			if (!vfd.ready || !queue.push(vfd))
+				releaseFrame(vfd);
+			else if (loading)
+				finishLoading(currentGeneration);
+		}
+	}
+};
@@ -0,0 +1,393 @@
+/*
+WAIVE-FRONT
+Copyright (C) 2024  Bram Bogaerts, Superposition
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "VideoLoader.cpp"
+#include "../data/DataSources.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Keeps a few items of the most likely categories opened ahead of time, so that switching to them is instant
+ *
+ * A background thread opens the demuxer and decoder of random items and decodes their first frame. When a layer
+ * switches to one of these warm items, it adopts the loader instead of opening the file itself. Categories are
+ * warmed in order of priority, with the most recently selected categories first, and the total number of open
+ * loaders is capped to bound memory use. The thread also scans the keyframes of videos that the layers could
+ * otherwise only seek in by estimate.
+ */
+class VideoPrefetcher
+{
+public:
+	/**
+	 * @brief Construct a new VideoPrefetcher object and start its thread
+	 *
+	 * @param itemsPerCategory Number of items to keep warm per category
+	 * @param maxLoaders Maximum number of warm loaders across all categories
+	 */
+	VideoPrefetcher(int itemsPerCategory = 2, int maxLoaders = 8)
+		: itemsPerCategory(std::max(1, itemsPerCategory)), maxLoaders(std::max(1, maxLoaders)), generator(std::random_device()())
+	{
+		running = true;
+		thread = std::thread(&VideoPrefetcher::run, this);
+	}
+
+	~VideoPrefetcher()
+	{
+		stop();
+	}
+
+	/**
+	 * @brief Stop the prefetch thread and free all warm loaders
+	 *
+	 */
+	void stop()
+	{
+		running = false;
+
+		// An item that is being opened would otherwise hold up closing the plugin
+		cancelled = true;
+
+		if (thread.joinable())
+			thread.join();
+
+		for (WarmItem &warmItem : warmItems)
+			delete warmItem.loader;
+
+		warmItems.clear();
+	}
+
+	/**
+	 * @brief Set the categories to warm, in their initial order of priority
+	 *
+	 * @param categories The categories
+	 */
+	void setCategories(const std::vector<DataCategory *> &categories)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		priorities = categories;
+	}
+
+	/**
+	 * @brief Move a category to the front of the priority list, because it was just selected
+	 *
+	 * @param category The category
+	 */
+	void prioritize(DataCategory *category)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		auto it = std::find(priorities.begin(), priorities.end(), category);
+		if (it != priorities.end())
+			priorities.erase(it);
+
+		priorities.insert(priorities.begin(), category);
+	}
+
+	/**
+	 * @brief Set the resolution the first frames of warm items are scaled down to
+	 *
+	 * @param width Target width, 0 for the source width
+	 * @param height Target height, 0 for the source height
+	 */
+	void setTargetSize(int width, int height)
+	{
+		targetWidth = width;
+		targetHeight = height;
+	}
+
+	/**
+	 * @brief Set whether warm items are read through a memory mapping
+	 *
+	 * @param memoryMapped Whether to map videos into memory
+	 */
+	void setMemoryMapped(bool memoryMapped)
+	{
+		this->memoryMapped = memoryMapped;
+	}
+
+	/**
+	 * @brief Set the number of decoders in the pool that warm items leave for the layers, whether the layers use them yet or not
+	 *
+	 * @param reservedDecoders Number of decoders, enough for every player of every layer
+	 */
+	void setReservedDecoders(int reservedDecoders)
+	{
+		this->reservedDecoders = reservedDecoders;
+	}
+
+	/**
+	 * @brief Pick a random warm item from a category
+	 *
+	 * @param category The category
+	 * @return DataItem* A warm item, or nullptr if none of the items in the category are warm
+	 */
+	DataItem *pickWarm(DataCategory *category)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		std::vector<DataItem *> candidates;
+
+		for (WarmItem &warmItem : warmItems)
+		{
+			if (warmItem.category == category)
+				candidates.push_back(warmItem.item);
+		}
+
+		if (candidates.size() == 0)
+			return nullptr;
+
+		return candidates[generator() % candidates.size()];
+	}
+
+	/**
+	 * @brief Take the warm loader of an item out of the warm set
+	 *
+	 * @param item The item
+	 * @return VideoLoader* The loader, owned by the caller, or nullptr if the item is not warm
+	 */
+	VideoLoader *take(DataItem *item)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (auto it = warmItems.begin(); it != warmItems.end(); it++)
+		{
+			if (it->item == item)
+			{
+				VideoLoader *loader = it->loader;
+				warmItems.erase(it);
+
+				return loader;
+			}
+		}
+
+		return nullptr;
+	}
+
+private:
+	/**
+	 * @brief An item with an opened loader
+	 *
+	 */
+	struct WarmItem
+	{
+		DataCategory *category; /**< The category the item was picked from */
+		DataItem *item;			/**< The item */
+		VideoLoader *loader;	/**< The loader, with its first frame decoded */
+	};
+
+	int itemsPerCategory; /**< Number of items to keep warm per category */
+	int maxLoaders;		  /**< Maximum number of warm loaders */
+
+	std::thread thread;		   /**< The prefetch thread */
+	std::atomic<bool> running; /**< Whether the prefetch thread should keep running */
+	std::atomic<bool> cancelled{false}; /**< Aborts the load in progress when set */
+
+	std::mutex mutex;						 /**< Guards the warm items, priorities, failed items and random generator */
+	std::vector<WarmItem> warmItems;		 /**< The warm items */
+	std::vector<DataCategory *> priorities;	 /**< Categories in order of priority */
+	std::map<DataItem *, std::chrono::steady_clock::time_point> failedItems; /**< Items that could not be warmed up, and when they may be tried again */
+	std::mt19937 generator;					 /**< Random generator for picking items */
+	std::atomic<int> targetWidth{0};		 /**< Width to scale first frames down to, 0 for the source width */
+	std::atomic<int> targetHeight{0};		 /**< Height to scale first frames down to, 0 for the source height */
+	std::atomic<bool> memoryMapped{false};	 /**< Whether warm items are read through a memory mapping */
+	std::atomic<int> reservedDecoders{7};	 /**< Number of pooled decoders left for the layers */
+
+	const std::chrono::seconds retryDelay{60}; /**< How long an item that could not be warmed up is skipped */
+
+	/**
+	 * @brief Check if a category is among those that should be kept warm (mutex must be held)
+	 *
+	 * @param category The category
+	 * @return true If the category should be kept warm
+	 * @return false If the category is too far down the priority list
+	 */
+	bool isWarmCategory(DataCategory *category)
+	{
+		size_t warmCategories = std::max(1, maxLoaders / itemsPerCategory);
+		size_t count = std::min(warmCategories, priorities.size());
+
+		return std::find(priorities.begin(), priorities.begin() + count, category) != priorities.begin() + count;
+	}
+
+	/**
+	 * @brief Remove a warm item whose category has dropped out of the warm categories (mutex must be held)
+	 *
+	 * @return VideoLoader* The loader of the removed item, to be freed by the caller, or nullptr if none was removed
+	 */
+	VideoLoader *evict()
+	{
+		for (auto it = warmItems.begin(); it != warmItems.end(); it++)
+		{
+			if (!isWarmCategory(it->category))
+			{
+				VideoLoader *loader = it->loader;
+				warmItems.erase(it);
+
+				return loader;
+			}
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * @brief Check if an item failed to warm up recently, forgetting the failure once it may be tried again (mutex must be held)
+	 *
+	 * @param item The item
+	 * @return true If the item should not be tried yet
+	 * @return false If the item can be warmed up
+	 */
+	bool hasFailed(DataItem *item)
+	{
+		auto it = failedItems.find(item);
+
+		if (it == failedItems.end())
+			return false;
+
+		if (std::chrono::steady_clock::now() < it->second)
+			return true;
+
+		failedItems.erase(it);
+		return false;
+	}
+
+	/**
+	 * @brief Pick the next item to warm up (mutex must be held)
+	 *
+	 * @param category The category the item was picked from
+	 * @return DataItem* The item, or nullptr if all warm categories have enough warm items
+	 */
+	DataItem *pickNext(DataCategory *&category)
+	{
+		size_t warmCategories = std::max(1, maxLoaders / itemsPerCategory);
+
+		for (size_t i = 0; i < priorities.size() && i < warmCategories; i++)
+		{
+			category = priorities[i];
+			std::vector<DataItem *> candidates;
+			int warm = 0;
+
+			for (WarmItem &warmItem : warmItems)
+			{
+				if (warmItem.category == category)
+					warm++;
+			}
+
+			if (warm >= itemsPerCategory)
+				continue;
+
+			for (DataItem *item : category->items)
+			{
+				bool isWarm = false;
+
+				for (WarmItem &warmItem : warmItems)
+				{
+					if (warmItem.item == item)
+					{
+						isWarm = true;
+						break;
+					}
+				}
+
+				if (!isWarm && !hasFailed(item))
+					candidates.push_back(item);
+			}
+
+			if (candidates.size() > 0)
+				return candidates[generator() % candidates.size()];
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * @brief Endlessly keep the warm categories topped up (should be run in a separate thread)
+	 *
+	 */
+	void run()
+	{
+		while (running)
+		{
+			// Keyframe scans go first, since the layer that asked for one is already playing the video
+			if (KeyframeScanner::get().scanNext(&cancelled))
+				continue;
+
+			DataCategory *category = nullptr;
+			DataItem *item = nullptr;
+			VideoLoader *evicted = nullptr;
+			int warm = 0;
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+
+				evicted = evict();
+				if (evicted == nullptr)
+					item = pickNext(category);
+
+				warm = warmItems.size();
+			}
+
+			if (evicted != nullptr)
+			{
+				delete evicted;
+				continue;
+			}
+
+			// Warm items only use the decoders the layers are not going to need, so decoders the layers hold are not counted twice
+			bool hasBudget = warm + 1 + reservedDecoders <= DecoderPool::get().getMaxDecoders();
+
+			if (item == nullptr || !hasBudget || !DecoderPool::get().hasCapacity(0))
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				continue;
+			}
+
+			VideoLoader *loader = new VideoLoader();
+			loader->setBudgeted(false);
+			loader->setTargetSize(targetWidth, targetHeight);
+			loader->setMemoryMapped(memoryMapped);
+			loader->setInterrupt(&cancelled);
+
+			bool warmed = loader->loadVideo(item->getVideoPath()) == 0 && loader->warmUp() == 0;
+
+			if (!warmed)
+			{
+				if (!cancelled)
+					warn("VIDEO", "Could not warm up " + item->title);
+
+				delete loader;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			// A cancelled load says nothing about the item, other failures may have been a full pool and are tried again later
+			if (warmed)
+				warmItems.push_back({category, item, loader});
+			else if (!cancelled)
+				failedItems[item] = std::chrono::steady_clock::now() + retryDelay;
+		}
+	}
+};
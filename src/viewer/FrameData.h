@@ -18,6 +18,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #pragma once
 
+struct AVFrame;
+
 /**
  * @brief Stores data of a frame
  *
@@ -25,8 +27,19 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 struct FrameData
 {
 	bool waiting = false; /**< Whether the frame is waiting to be displayed */
+	AVFrame *frame = nullptr; /**< Reference-counted frame that owns the data, released when the next frame replaces it */
 	unsigned char *data;  /**< Data of the frame */
 	int width;			  /**< Width of the frame */
 	int height;			  /**< Height of the frame */
+	int stride;			  /**< Bytes per row of the frame */
+	int format;			  /**< Pixel layout of the frame, see VideoFrameFormat */
+	unsigned char *chroma[2]; /**< Chroma planes of YUV frames */
+	int chromaStride[2];	  /**< Bytes per row of the chroma planes */
+	bool bt709;				  /**< Whether YUV frames use BT.709 coefficients */
+	bool fullRange;			  /**< Whether YUV frames use the full range */
+	int loopClip = 0;		  /**< Loop the frame belongs to, 0 if it is not numbered */
+	int loopFrame = -1;		  /**< Index of the frame within its loop */
+	int loopLength = 0;		  /**< Number of frames in the loop, 0 if unknown */
+	bool indexOnly = false;	  /**< Whether the frame has no data, and is shown from the layer of a loop the texture holds */
 	float colors[3 * 5];  /**< Colors of the frame */
 };
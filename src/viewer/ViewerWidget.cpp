@@ -27,21 +27,29 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <GL/glew.h>
 #endif
 
+extern "C"
+{
+#include "libavutil/frame.h"
+}
+
 #include "util/Color.cpp"
 #include "FrameData.h"
+#include "../video/VideoFrameDescription.h"
 #include "../shader/ShaderRectangle.h"
 #include "../shader/ShaderProgram.cpp"
-#include "../shader/ShaderTexture.cpp"
+#include "../shader/ShaderVideoTexture.cpp"
 #include "../shader/ShaderUniforms.h"
 #include <iostream>
 #include <vector>
 #include <chrono>
+#include <utility>
+#include <algorithm>
 
 START_NAMESPACE_DISTRHO
 
 using Shader::ShaderProgram;
 using Shader::ShaderRectangle;
-using Shader::ShaderTexture;
+using Shader::ShaderVideoTexture;
 using Shader::ShaderUniforms;
 
 /**
@@ -95,33 +103,183 @@ public:
 	}
 
 	/**
-	 * @brief Set the frame data
+	 * @brief Set the frame data, taking over the reference to the decoded frame so that nothing is copied
 	 *
 	 * @param i The index of the layer to set the frame data for
-	 * @param frame The frame data
-	 * @param width The width of the frame
-	 * @param height The height of the frame
-	 * @param colors The colors of the frame
+	 * @param vfd The frame, whose frame is nullptr afterwards if it was taken over
 	 */
-	void setFrame(int i, uint8_t *frame, int width, int height, std::vector<float> colors)
+	void setFrame(int i, VideoFrameDescription &vfd)
 	{
 		if (!isInitialized())
 			return;
 
-		delete[] frameData[i]->data;
+		takeFrame(frameData[i], vfd);
+	}
 
-		uint8_t* data = new uint8_t[width * height * 3];
-		memcpy(data, frame, width * height * 3);
+	/**
+	 * @brief Set the frame data of the item a layer is fading out from, taking over the reference to the decoded frame
+	 *
+	 * @param i The index of the layer
+	 * @param vfd The frame, whose frame is nullptr afterwards if it was taken over
+	 */
+	void setOutgoingFrame(int i, VideoFrameDescription &vfd)
+	{
+		if (!isInitialized())
+			return;
 
-		frameData[i]->data = data;
-		frameData[i]->width = width;
-		frameData[i]->height = height;
-		frameData[i]->waiting = true;
+		takeFrame(outgoingFrameData[i], vfd);
+	}
 
-		for (int j = 0; j < 3 * 5; j++)
+	/**
+	 * @brief Start fading a layer from the frame it shows now to the frames set from here on
+	 *
+	 * The current frame and texture become the outgoing ones, so nothing has to be copied.
+	 *
+	 * @param i The index of the layer
+	 * @param duration Duration of the fade in seconds, 0 to cut
+	 */
+	void crossfade(int i, float duration)
+	{
+		if (!isInitialized())
+			return;
+
+		std::swap(frameData[i], outgoingFrameData[i]);
+		std::swap(textures[i], outgoingTextures[i]);
+
+		fadeStart[i] = std::chrono::steady_clock::now();
+		fadeDuration[i] = duration;
+	}
+
+	/**
+	 * @brief Show the frames of another layer on a layer, which then needs no frames or texture of its own
+	 *
+	 * @param i The index of the layer
+	 * @param source The index of the layer whose frames to show
+	 */
+	void share(int i, int source)
+	{
+		if (!isInitialized())
+			return;
+
+		sources[i] = source;
+	}
+
+	/**
+	 * @brief Stop showing the frames of another layer on a layer, giving one of the two a reference to the frame on screen
+	 *
+	 * @param i The index of the layer
+	 * @param handOver Whether the layer takes over the frames and texture it shows, leaving the reference to the other layer
+	 */
+	void unshare(int i, bool handOver)
+	{
+		if (!isInitialized() || sources[i] == i)
+			return;
+
+		int source = sources[i];
+		sources[i] = i;
+
+		if (handOver)
 		{
-			frameData[i]->colors[j] = colors[j];
+			std::swap(frameData[i], frameData[source]);
+			std::swap(textures[i], textures[source]);
+
+			referenceFrame(frameData[source], frameData[i]);
 		}
+		else
+		{
+			referenceFrame(frameData[i], frameData[source]);
+		}
+	}
+
+	/**
+	 * @brief Release the frames, loops and texture memory of a layer that is disabled, which shows nothing until its next frame
+	 *
+	 * @param i The index of the layer
+	 */
+	void clearLayer(int i)
+	{
+		if (!isInitialized())
+			return;
+
+		releaseFrame(frameData[i]);
+		releaseFrame(outgoingFrameData[i]);
+
+		releaseLoop(textures[i]);
+		releaseLoop(outgoingTextures[i]);
+		textures[i]->clear();
+		outgoingTextures[i]->clear();
+
+		fadeDuration[i] = 0.0f;
+	}
+
+	/**
+	 * @brief Check if a layer is fading from one item to the next
+	 *
+	 * @param i The index of the layer
+	 * @return true If the outgoing item is still visible
+	 * @return false Otherwise
+	 */
+	bool isCrossfading(int i)
+	{
+		return isInitialized() && getFade(i) < 1.0f;
+	}
+
+	/**
+	 * @brief Get the loop a layer holds every frame of on the GPU, which its player can then play by index alone
+	 *
+	 * @param i The index of the layer
+	 * @param outgoing Whether to check the item the layer is fading out from
+	 * @return int The loop, as numbered in the frames, or 0 for none
+	 */
+	int getResidentLoop(int i, bool outgoing = false)
+	{
+		if (!isInitialized())
+			return 0;
+
+		ShaderVideoTexture *texture = outgoing ? outgoingTextures[i] : textures[i];
+
+		if (texture->loopClip == 0 || std::find(texture->loopFrames.begin(), texture->loopFrames.end(), false) != texture->loopFrames.end())
+			return 0;
+
+		return texture->loopClip;
+	}
+
+	/**
+	 * @brief Set how much GPU memory loops may take, which applies to loops collected from then on
+	 *
+	 * @param bytes Maximum size in bytes, 0 to not hold loops
+	 */
+	void setMaxLoopMemory(size_t bytes)
+	{
+		maxLoopBytes = bytes;
+	}
+
+	/**
+	 * @brief Get how much GPU memory the loops that are held take
+	 *
+	 * @return size_t Size in bytes
+	 */
+	size_t getLoopMemory()
+	{
+		return loopBytes;
+	}
+
+	/**
+	 * @brief Get the resolution a layer is drawn at on screen, which is the most detail decoded frames need to have
+	 *
+	 * The layer is largest at the first color index, where it is drawn at the window size times the zoom factor. The
+	 * result is rounded up to a multiple of 64 pixels, so resizing the window does not reconfigure the decoders on
+	 * every pixel.
+	 *
+	 * @param width The target width
+	 * @param height The target height
+	 */
+	void getTargetSize(int &width, int &height)
+	{
+		float size = 1.0f + parameters[Parameters::Zoom] * 10.0f;
+
+		width = ((int)(getWidth() * size) + 63) / 64 * 64;
+		height = ((int)(getHeight() * size) + 63) / 64 * 64;
 	}
 
 protected:
@@ -161,11 +319,119 @@ private:
 	bool initialized = false; /**< Whether the widget has been initialized */
 
 	std::vector<FrameData *> frameData;	   /**< The frame data for each layer */
-	std::vector<ShaderTexture *> textures; /**< The textures for each layer */
+	std::vector<ShaderVideoTexture *> textures; /**< The textures for each layer */
+	std::vector<FrameData *> outgoingFrameData;		   /**< The frame data each layer is fading out from */
+	std::vector<ShaderVideoTexture *> outgoingTextures; /**< The textures each layer is fading out from */
+	std::chrono::steady_clock::time_point fadeStart[3]; /**< When each layer started fading */
+	float fadeDuration[3] = {0.0f, 0.0f, 0.0f};		   /**< Duration of the fade of each layer in seconds */
+	int sources[3] = {0, 1, 2};						   /**< The layer whose frames each layer shows */
+	size_t loopBytes = 0;								   /**< GPU memory taken by the loops that are held */
+	size_t maxLoopBytes = (size_t)512 * 1024 * 1024;	   /**< Maximum GPU memory loops may take */
+	int chromaUnits[2] = {1, 2};				/**< The texture units of the chroma planes */
 	ShaderProgram shaderProgram;		   /**< The shader program */
 	ShaderRectangle rectangle;			   /**< The shader rectangle */
 	ShaderUniforms uniforms;			   /**< The shader uniforms */
 
+	/**
+	 * @brief Take over the reference to a decoded frame, to be uploaded before the next draw
+	 *
+	 * The frame stays referenced until the next one replaces it, so that the frame on screen can be shared without
+	 * copying it. Frames of a loop the GPU holds carry no frame, only the layer to show.
+	 *
+	 * @param fd The frame data to set
+	 * @param vfd The frame, whose frame is nullptr afterwards if it was taken over
+	 */
+	void takeFrame(FrameData *fd, VideoFrameDescription &vfd)
+	{
+		fd->loopClip = vfd.loopClip;
+		fd->loopFrame = vfd.loopFrame;
+		fd->loopLength = vfd.loopLength;
+		fd->indexOnly = vfd.data == nullptr;
+		fd->waiting = true;
+
+		for (int j = 0; j < 3 * 5; j++)
+		{
+			fd->colors[j] = vfd.colors[j];
+		}
+
+		if (fd->indexOnly)
+			return;
+
+		int chromaPlanes = vfd.format == FrameFormatYUV420P ? 2 : vfd.format == FrameFormatNV12 ? 1 : 0;
+
+		for (int p = 0; p < chromaPlanes; p++)
+		{
+			fd->chroma[p] = vfd.chroma[p];
+			fd->chromaStride[p] = vfd.chromaStride[p];
+		}
+
+		av_frame_free(&fd->frame);
+		fd->frame = vfd.frame;
+		vfd.frame = nullptr;
+
+		fd->data = vfd.data;
+		fd->width = vfd.width;
+		fd->height = vfd.height;
+		fd->stride = vfd.stride;
+		fd->format = vfd.format;
+		fd->bt709 = vfd.bt709;
+		fd->fullRange = vfd.fullRange;
+	}
+
+	/**
+	 * @brief Give frame data a new reference to the frame of other frame data, to be uploaded as a single frame before the next draw
+	 *
+	 * @param fd The frame data to set
+	 * @param source The frame data to reference
+	 */
+	void referenceFrame(FrameData *fd, const FrameData *source)
+	{
+		AVFrame *frame = source->frame != nullptr ? av_frame_clone(source->frame) : nullptr;
+
+		if (frame == nullptr)
+			return;
+
+		av_frame_free(&fd->frame);
+		fd->frame = frame;
+
+		// The new reference points at the same buffers, so the planes are where they were
+		fd->data = source->data;
+		fd->chroma[0] = source->chroma[0];
+		fd->chroma[1] = source->chroma[1];
+		fd->chromaStride[0] = source->chromaStride[0];
+		fd->chromaStride[1] = source->chromaStride[1];
+		fd->width = source->width;
+		fd->height = source->height;
+		fd->stride = source->stride;
+		fd->format = source->format;
+		fd->bt709 = source->bt709;
+		fd->fullRange = source->fullRange;
+
+		// The frame belongs to no loop here, so it does not take a loop's worth of memory in the texture it goes to
+		fd->loopClip = 0;
+		fd->loopFrame = -1;
+		fd->loopLength = 0;
+		fd->indexOnly = false;
+		fd->waiting = true;
+
+		for (int j = 0; j < 3 * 5; j++)
+		{
+			fd->colors[j] = source->colors[j];
+		}
+	}
+
+	/**
+	 * @brief Release the frame of frame data, which then has nothing to show
+	 *
+	 * @param fd The frame data
+	 */
+	void releaseFrame(FrameData *fd)
+	{
+		av_frame_free(&fd->frame);
+		fd->data = nullptr;
+		fd->waiting = false;
+	}
+
 	/**
 	 * @brief Initialize the widget
 	 *
@@ -175,13 +441,18 @@ private:
 		shaderProgram.init();
 		rectangle.init();
 		uniforms.init(&shaderProgram);
+		uniforms.texU.set(&chromaUnits[0]);
+		uniforms.texV.set(&chromaUnits[1]);
 
 		for (int i = 0; i < 3; i++)
 		{
 			frameData.push_back(new FrameData());
-			textures.push_back(new ShaderTexture());
+			textures.push_back(new ShaderVideoTexture());
+			outgoingFrameData.push_back(new FrameData());
+			outgoingTextures.push_back(new ShaderVideoTexture());
 
 			textures[i]->init();
+			outgoingTextures[i]->init();
 		}
 
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -196,14 +467,124 @@ private:
 	{
 		for (int i = 0; i < 3; i++)
 		{
-			FrameData *fd = frameData[i];
+			updateTexture(frameData[i], textures[i]);
 
-			if (fd->waiting)
+			if (getFade(i) < 1.0f)
 			{
-				fd->waiting = false;
-				textures[i]->set(fd->data, fd->width, fd->height);
+				updateTexture(outgoingFrameData[i], outgoingTextures[i]);
 			}
+			else if (outgoingFrameData[i]->frame != nullptr || outgoingTextures[i]->loopClip != 0)
+			{
+				// The outgoing item is no longer visible, so its frame and loop only take memory
+				releaseFrame(outgoingFrameData[i]);
+
+				if (outgoingTextures[i]->loopClip != 0)
+				{
+					releaseLoop(outgoingTextures[i]);
+					outgoingTextures[i]->clear();
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Upload frame data to a texture if it is waiting
+	 *
+	 * @param fd The frame data
+	 * @param texture The texture
+	 */
+	void updateTexture(FrameData *fd, ShaderVideoTexture *texture)
+	{
+		if (!fd->waiting)
+			return;
+
+		fd->waiting = false;
+
+		// A loop that is no longer held keeps showing its last frame, until the player decodes again
+		if (fd->indexOnly)
+		{
+			if (fd->loopClip == texture->loopClip && fd->loopFrame >= 0 && fd->loopFrame < (int)texture->loopFrames.size() && texture->loopFrames[fd->loopFrame])
+				texture->layer = fd->loopFrame;
+
+			return;
+		}
+
+		unsigned char *planes[3] = {fd->data, fd->chroma[0], fd->chroma[1]};
+		int strides[3] = {fd->stride, fd->chromaStride[0], fd->chromaStride[1]};
+
+		if (holdLoop(fd, texture))
+		{
+			texture->set(fd->format, planes, strides, fd->width, fd->height, fd->loopFrame, fd->loopLength);
+			texture->loopFrames[fd->loopFrame] = true;
+		}
+		else
+		{
+			texture->set(fd->format, planes, strides, fd->width, fd->height);
 		}
+
+		texture->bt709 = fd->bt709;
+		texture->fullRange = fd->fullRange;
+	}
+
+	/**
+	 * @brief Make sure a texture holds the loop a frame belongs to, if the loop fits in the memory that is left
+	 *
+	 * @param fd The frame data
+	 * @param texture The texture
+	 * @return true If the frame can be set in its layer of the loop
+	 * @return false If the frame has to be set on its own
+	 */
+	bool holdLoop(FrameData *fd, ShaderVideoTexture *texture)
+	{
+		bool numbered = fd->loopClip != 0 && fd->loopLength > 0 && fd->loopFrame >= 0 && fd->loopFrame < fd->loopLength;
+		size_t size = (size_t)fd->loopLength * ShaderVideoTexture::getLayerSize(fd->format, fd->width, fd->height);
+
+		// Frames that change size, as when the window is resized, start the loop over
+		if (numbered && texture->loopClip == fd->loopClip && texture->loopSize == size && (int)texture->loopFrames.size() == fd->loopLength)
+			return true;
+
+		releaseLoop(texture);
+
+		if (!numbered || loopBytes + size > maxLoopBytes)
+			return false;
+
+		texture->loopClip = fd->loopClip;
+		texture->loopFrames.assign(fd->loopLength, false);
+		texture->loopSize = size;
+		loopBytes += size;
+
+		return true;
+	}
+
+	/**
+	 * @brief Stop holding the loop of a texture, whose layers are reallocated by the next frame that is set
+	 *
+	 * @param texture The texture
+	 */
+	void releaseLoop(ShaderVideoTexture *texture)
+	{
+		loopBytes -= texture->loopSize;
+
+		texture->loopClip = 0;
+		texture->loopFrames.clear();
+		texture->loopSize = 0;
+	}
+
+	/**
+	 * @brief Get how far a layer has faded to its new item
+	 *
+	 * @param i The index of the layer
+	 * @return float Progress of the fade, 1 once only the new item is visible
+	 */
+	float getFade(int i)
+	{
+		// Before the first item there is nothing to fade from
+		if (fadeDuration[i] <= 0.0f || outgoingFrameData[i]->data == nullptr)
+			return 1.0f;
+
+		float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - fadeStart[i]).count();
+
+		return clip(elapsed / fadeDuration[i], 0.0f, 1.0f);
 	}
 
 	/**
@@ -247,18 +628,41 @@ private:
 				if (!(*layersEnabled)[i])
 					continue;
 
-				uniforms.colors.set(frameData[i]->colors);
-
 				float size = 1.0f - (parameters[Parameters::Space] * (1.0 + parameters[Parameters::Zoom] * 10.0)) * j + parameters[Parameters::Zoom] * 10.0f;
 				uniforms.size.set(&size);
 
-				textures[i]->bind();
-				uniforms.use();
-				rectangle.draw();
+				float fade = getFade(i);
+
+				// The new item is drawn first and the outgoing one over it, so where both cover a pixel the mix is exact
+				drawLayer(frameData[sources[i]], textures[sources[i]], 1.0f);
+
+				if (fade < 1.0f)
+					drawLayer(outgoingFrameData[i], outgoingTextures[i], 1.0f - fade);
 			}
 		}
 	}
 
+	/**
+	 * @brief Draw a single item of a layer at the current color index and size
+	 *
+	 * @param fd The frame data of the item
+	 * @param texture The texture of the item
+	 * @param opacity The opacity to draw with
+	 */
+	void drawLayer(FrameData *fd, ShaderVideoTexture *texture, float opacity)
+	{
+		uniforms.colors.set(fd->colors);
+		uniforms.opacity.set(&opacity);
+		uniforms.format.set(&texture->format);
+		uniforms.bt709.set(&texture->bt709);
+		uniforms.fullRange.set(&texture->fullRange);
+		uniforms.layer.set(&texture->layer);
+
+		texture->bind();
+		uniforms.use();
+		rectangle.draw();
+	}
+
 	DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ViewerWidget)
 };
 